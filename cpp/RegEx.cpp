@@ -1,74 +1,325 @@
 
 #include "RegEx.h"
+#include "unicode_tables.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
 
 namespace RegEx
 {
 
-bool match(const char *pattern, const char *str)
+namespace
 {
-    auto dfa = compile(pattern);
-    return dfa(str);
-}
 
-DFA compile(const char *pattern)
+typedef std::chrono::steady_clock clock_type;
+
+enum class Phase
 {
-    return DFA::from_regex(pattern);
-}
+    parse,
+    construct,
+    determinize,
+    minimize,
+    table,
+};
 
-template <class T>
-bool in(const T &s, const std::vector<T> &vec)
+/**
+ * The state of the RegEx::compile call running on this thread.
+ */
+struct compile_context
 {
-    return std::find(vec.begin(), vec.end(), s) != vec.end();
+    const compile_options *options;
+    clock_type::time_point start;
+    long long baseline_bytes;
+
+    compile_stats *stats;
+    Phase phase;
+    clock_type::time_point since;
+};
+
+thread_local compile_context *t_context = nullptr;
+
+compile_stats *current_stats()
+{
+    return t_context ? t_context->stats : nullptr;
 }
 
-DFA::transition_rule::transition_rule(unsigned _p, char _a, unsigned _q)
-    : p(_p), a(_a), q(_q)
+/**
+ * Throw if the compilation running on this thread, about to have @num_states DFA states
+ * and to allocate @extra_bytes, exceeds its budget.
+ */
+void check_budget(unsigned num_states, std::size_t extra_bytes = 0)
 {
+    if (!t_context)
+    {
+        return;
+    }
+    const auto &options = *t_context->options;
+    if (options.max_states && num_states > options.max_states)
+    {
+        throw BudgetException(BudgetException::Budget::states);
+    }
+    if (options.max_memory)
+    {
+        auto bytes = uint_set::usage().current - t_context->baseline_bytes + static_cast<long long>(extra_bytes);
+        if (bytes > static_cast<long long>(options.max_memory))
+        {
+            throw BudgetException(BudgetException::Budget::memory);
+        }
+    }
+    if (options.max_seconds > 0 &&
+        std::chrono::duration<double>(clock_type::now() - t_context->start).count() > options.max_seconds)
+    {
+        throw BudgetException(BudgetException::Budget::time);
+    }
 }
 
-DFA::transition_rule_set::transition_rule_set(const uint_set &_p, char _a, const uint_set &_q)
-    : p(_p), a(_a), q(_q)
+/**
+ * Charge the time since the last switch to the current phase, then enter @phase.
+ */
+void switch_phase(compile_context &context, Phase phase)
 {
+    auto now = clock_type::now();
+    double seconds = std::chrono::duration<double>(now - context.since).count();
+    switch (context.phase)
+    {
+    case Phase::parse:
+        context.stats->parse_seconds += seconds;
+        break;
+    case Phase::construct:
+        context.stats->construct_seconds += seconds;
+        break;
+    case Phase::determinize:
+        context.stats->determinize_seconds += seconds;
+        break;
+    case Phase::minimize:
+        context.stats->minimize_seconds += seconds;
+        break;
+    case Phase::table:
+        context.stats->table_seconds += seconds;
+        break;
+    }
+    context.phase = phase;
+    context.since = now;
 }
 
-class ParsingException : public std::exception
+/**
+ * Attribute the time spent in a scope (minus nested scopes) to @phase.
+ */
+class phase_scope
 {
 public:
-    ParsingException(const char *msg) : m_msg(msg)
+    phase_scope(Phase phase)
+        : m_context(current_stats() ? t_context : nullptr), m_previous(m_context ? m_context->phase : phase)
     {
+        if (m_context)
+        {
+            switch_phase(*m_context, phase);
+        }
     }
 
-    const char *what() const throw() override
+    ~phase_scope()
     {
-        return m_msg;
+        if (m_context)
+        {
+            switch_phase(*m_context, m_previous);
+        }
     }
 
 private:
-    const char *m_msg;
+    compile_context *m_context;
+    Phase m_previous;
 };
 
-DFA::DFA(unsigned s, const uint_set &F, const Rules_t &R) : m_s(s), m_F(F), m_R(R)
+/**
+ * Install @context for the calling thread for the lifetime of the scope.
+ */
+class context_scope
 {
-    m_num_states = 0;
-    uint_set states;
-    for (const auto &rule : m_R)
+public:
+    context_scope(compile_context *context) : m_previous(t_context)
+    {
+        t_context = context;
+    }
+
+    ~context_scope()
+    {
+        t_context = m_previous;
+    }
+
+private:
+    compile_context *m_previous;
+};
+
+thread_local bool t_defer_tables = false;
+
+/**
+ * For the lifetime of the scope, DFAs built on the calling thread count their states but leave
+ * their transition tables out: the intermediate automata of a compile are only combined by
+ * their rules, and only the result needs a table.
+ */
+class table_deferral
+{
+public:
+    table_deferral() : m_previous(t_defer_tables)
+    {
+        t_defer_tables = true;
+    }
+
+    ~table_deferral()
+    {
+        t_defer_tables = m_previous;
+    }
+
+private:
+    bool m_previous;
+};
+
+} // namespace
+
+bool match(const char *pattern, const char *str)
+{
+    auto dfa = compile(pattern);
+    return dfa(str);
+}
+
+DFA compile(const char *pattern, compile_stats *stats)
+{
+    return compile(pattern, compile_options(), stats);
+}
+
+DFA compile(const char *pattern, const compile_options &options, compile_stats *stats)
+{
+    auto &usage = uint_set::usage();
+    auto now = clock_type::now();
+    compile_context context{&options, now, usage.current, stats, Phase::parse, now};
+    context_scope scope(&context);
+    if (!stats)
+    {
+        return DFA::from_regex(pattern, options);
+    }
+
+    *stats = compile_stats();
+    usage.peak = usage.current;
+    auto dfa = DFA::from_regex(pattern, options);
+    switch_phase(context, Phase::parse);
+
+    stats->peak_set_bytes = usage.peak - context.baseline_bytes;
+    return dfa;
+}
+
+std::vector<DFA> compile_many(const std::vector<std::string> &patterns, const compile_options &options, unsigned threads)
+{
+    // the distinct patterns, in order of first occurrence
+    std::unordered_map<std::string, unsigned> index;
+    std::vector<const std::string *> distinct;
+    std::vector<unsigned> distinct_of(patterns.size());
+    for (std::size_t i = 0; i < patterns.size(); ++i)
     {
-        if (!states.has(rule.p))
+        auto inserted = index.emplace(patterns[i], distinct.size());
+        if (inserted.second)
         {
-            states.add(rule.p);
-            ++m_num_states;
+            distinct.push_back(&patterns[i]);
         }
-        if (!states.has(rule.q))
+        distinct_of[i] = inserted.first->second;
+    }
+
+    // each thread takes the next pattern until none are left; compile keeps its state per thread
+    std::vector<std::unique_ptr<DFA>> compiled(distinct.size());
+    std::vector<std::exception_ptr> errors(distinct.size());
+    std::atomic<std::size_t> next(0);
+    auto work = [&]() {
+        for (std::size_t k = next++; k < distinct.size(); k = next++)
+        {
+            try
+            {
+                compiled[k].reset(new DFA(compile(distinct[k]->c_str(), options)));
+            }
+            catch (...)
+            {
+                errors[k] = std::current_exception();
+            }
+        }
+    };
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<std::size_t>(threads, distinct.size());
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t)
+    {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto &thread : pool)
+    {
+        thread.join();
+    }
+
+    for (const auto &error : errors)
+    {
+        if (error)
         {
-            states.add(rule.q);
-            ++m_num_states;
+            std::rethrow_exception(error);
         }
     }
+    // duplicates get copies; the last occurrence takes the compiled DFA
+    std::vector<std::size_t> last(distinct.size());
+    for (std::size_t i = 0; i < patterns.size(); ++i)
+    {
+        last[distinct_of[i]] = i;
+    }
+    std::vector<DFA> dfas;
+    dfas.reserve(patterns.size());
+    for (std::size_t i = 0; i < patterns.size(); ++i)
+    {
+        auto &dfa = *compiled[distinct_of[i]];
+        dfas.push_back(last[distinct_of[i]] == i ? std::move(dfa) : dfa);
+    }
+    return dfas;
+}
+
+template <class T>
+bool in(const T &s, const std::vector<T> &vec)
+{
+    return std::find(vec.begin(), vec.end(), s) != vec.end();
+}
+
+DFA::transition_rule::transition_rule(unsigned _p, char _a, unsigned _q)
+    : p(_p), a(_a), b(_a), q(_q)
+{
+}
+
+DFA::transition_rule::transition_rule(unsigned _p, char _a, char _b, unsigned _q)
+    : p(_p), a(_a), b(_b), q(_q)
+{
+}
+
+DFA::transition_rule_set::transition_rule_set(const uint_set &_p, char _a, char _b, const uint_set &_q)
+    : p(_p), a(_a), b(_b), q(_q)
+{
+}
 
+DFA::DFA(unsigned s, const uint_set &F, const Rules_t &R) : m_s(s), m_F(F), m_R(R)
+{
+    build_table();
     reset();
 }
 
@@ -76,6 +327,7 @@ DFA::DFA(uint_set s_set, const std::vector<uint_set> &F_set, const SRules_t &R_s
 {
     std::vector<uint_set> set_states;
 
+    m_R.reserve(R_set.size());
     for (const auto &rule_set : R_set)
     {
         transition_rule rule;
@@ -100,6 +352,7 @@ DFA::DFA(uint_set s_set, const std::vector<uint_set> &F_set, const SRules_t &R_s
             rule.q = it_q - set_states.begin();
         }
         rule.a = rule_set.a;
+        rule.b = rule_set.b;
         m_R.push_back(rule);
     }
 
@@ -110,6 +363,254 @@ DFA::DFA(uint_set s_set, const std::vector<uint_set> &F_set, const SRules_t &R_s
         unsigned f = std::find(set_states.begin(), set_states.end(), f_set) - set_states.begin();
         m_F.add(f);
     }
+
+    build_table();
+    reset();
+}
+
+namespace
+{
+
+/**
+ * Fill @table, indexed by state * @width + byte class, from the @columns of the byte intervals,
+ * laid end to end, each num_states + 1 long. The last entry of each column is the trap state.
+ */
+template <class State>
+void fill_table(std::vector<State> &table, const std::vector<unsigned> &columns, unsigned num_states,
+                const std::vector<unsigned char> &interval_class, unsigned width)
+{
+    table.assign((num_states + 1) * width, num_states);
+    for (unsigned i = 0; i < interval_class.size(); ++i)
+    {
+        const unsigned *column = columns.data() + i * (num_states + 1);
+        for (unsigned p = 0; p < num_states; ++p)
+        {
+            table[p * width + interval_class[i]] = column[p];
+        }
+    }
+}
+
+} // namespace
+
+void DFA::build_table()
+{
+    phase_scope phase(Phase::table);
+    m_num_states = m_s + 1;
+    for (const auto &rule : m_R)
+    {
+        m_num_states = std::max(m_num_states, std::max(rule.p, rule.q) + 1);
+    }
+    for (const auto &f : m_F)
+    {
+        m_num_states = std::max(m_num_states, f + 1);
+    }
+    const unsigned trap = m_num_states;
+    if (t_defer_tables)
+    {
+        check_budget(m_num_states);
+        return;
+    }
+
+    // cut the bytes into intervals at the rule boundaries; '\0' stays alone and always traps
+    bool cut[257] = {true, true};
+    for (const auto &rule : m_R)
+    {
+        if (rule.a != '\0')
+        {
+            cut[static_cast<unsigned char>(rule.a)] = true;
+            cut[static_cast<unsigned char>(rule.b) + 1] = true;
+        }
+    }
+    unsigned char interval[256];
+    unsigned num_intervals = 0;
+    for (unsigned c = 0; c < 256; ++c)
+    {
+        num_intervals += cut[c];
+        interval[c] = num_intervals - 1;
+    }
+
+    // column of each interval; the first rule wins, as in a linear scan
+    check_budget(m_num_states, (m_num_states + 1) * num_intervals * sizeof(unsigned));
+    // one allocation for all of them
+    const unsigned height = m_num_states + 1;
+    std::vector<unsigned> columns(num_intervals * height, trap);
+    for (const auto &rule : m_R)
+    {
+        if (rule.a == '\0')
+        {
+            continue;
+        }
+        unsigned last = interval[static_cast<unsigned char>(rule.b)];
+        for (unsigned i = interval[static_cast<unsigned char>(rule.a)]; i <= last; ++i)
+        {
+            auto &q = columns[i * height + rule.p];
+            if (q == trap)
+            {
+                q = rule.q;
+            }
+        }
+    }
+
+    // intervals with the same column form one byte class, numbered in order of first interval:
+    // sorting the intervals by column brings each class together, its first interval in front
+    auto column = [&](unsigned i) { return columns.begin() + i * height; };
+    std::vector<unsigned> order(num_intervals);
+    for (unsigned i = 0; i < num_intervals; ++i)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](unsigned x, unsigned y) {
+        if (std::equal(column(x), column(x) + height, column(y)))
+        {
+            return x < y;
+        }
+        return std::lexicographical_compare(column(x), column(x) + height, column(y), column(y) + height);
+    });
+    std::vector<unsigned> first(num_intervals);
+    for (unsigned k = 0; k < num_intervals; ++k)
+    {
+        unsigned i = order[k];
+        bool same = k > 0 && std::equal(column(i), column(i) + height, column(order[k - 1]));
+        first[i] = same ? first[order[k - 1]] : i;
+    }
+    std::vector<unsigned char> interval_class(num_intervals);
+    m_num_classes = 0;
+    for (unsigned i = 0; i < num_intervals; ++i)
+    {
+        interval_class[i] = first[i] == i ? m_num_classes++ : interval_class[first[i]];
+    }
+    m_classes.resize(256);
+    for (unsigned c = 0; c < 256; ++c)
+    {
+        m_classes[c] = interval_class[interval[c]];
+    }
+
+    m_table8 = {};
+    m_table16 = {};
+    m_table32 = {};
+    if (trap <= 0xFF)
+    {
+        fill_table(m_table8.single, columns, m_num_states, interval_class, m_num_classes);
+    }
+    else if (trap <= 0xFFFF)
+    {
+        fill_table(m_table16.single, columns, m_num_states, interval_class, m_num_classes);
+    }
+    else
+    {
+        fill_table(m_table32.single, columns, m_num_states, interval_class, m_num_classes);
+    }
+    classify_states();
+}
+
+const unsigned char DFA::final_flag;
+const unsigned char DFA::dead_flag;
+const unsigned char DFA::absorbing_flag;
+
+void DFA::classify_states()
+{
+    const unsigned trap = m_num_states;
+    const unsigned width = m_num_classes;
+    // '\0' always leads to the trap; skip its class unless other bytes share it
+    std::vector<bool> skipped(width);
+    skipped[m_classes[0]] = std::count(m_classes.begin(), m_classes.end(), m_classes[0]) == 1;
+    m_flags.assign(trap + 1, 0);
+    // the predecessors of q are predecessors[begin[q]] to predecessors[begin[q + 1]], in one
+    // allocation rather than one per state, as every intermediate automaton of a compile gets here
+    std::vector<unsigned> begin(trap + 2);
+    for (unsigned p = 0; p <= trap; ++p)
+    {
+        if (p != trap && m_F.has(p))
+        {
+            m_flags[p] = final_flag;
+        }
+        for (unsigned k = 0; k < width; ++k)
+        {
+            begin[transition(p * width + k) + 1] += !skipped[k];
+        }
+    }
+    for (unsigned q = 0; q <= trap; ++q)
+    {
+        begin[q + 1] += begin[q];
+    }
+    std::vector<unsigned> predecessors(begin[trap + 1]);
+    std::vector<unsigned> end(begin.begin(), begin.end() - 1);
+    for (unsigned p = 0; p <= trap; ++p)
+    {
+        for (unsigned k = 0; k < width; ++k)
+        {
+            if (!skipped[k])
+            {
+                predecessors[end[transition(p * width + k)]++] = p;
+            }
+        }
+    }
+
+    // live states reach a final one; absorbing states are what remains of the final ones after
+    // dropping, transitively, those with a byte leading out of them
+    std::vector<bool> live(trap + 1);
+    std::vector<bool> absorbing(trap + 1);
+    std::vector<unsigned> work;
+    for (unsigned q = 0; q < trap; ++q)
+    {
+        if (m_flags[q] & final_flag)
+        {
+            live[q] = absorbing[q] = true;
+            work.push_back(q);
+        }
+    }
+    while (!work.empty())
+    {
+        unsigned q = work.back();
+        work.pop_back();
+        for (unsigned j = begin[q]; j < begin[q + 1]; ++j)
+        {
+            unsigned p = predecessors[j];
+            if (!live[p])
+            {
+                live[p] = true;
+                work.push_back(p);
+            }
+        }
+    }
+    for (unsigned q = 0; q <= trap; ++q)
+    {
+        if (!absorbing[q])
+        {
+            work.push_back(q);
+        }
+    }
+    while (!work.empty())
+    {
+        unsigned q = work.back();
+        work.pop_back();
+        for (unsigned j = begin[q]; j < begin[q + 1]; ++j)
+        {
+            unsigned p = predecessors[j];
+            if (absorbing[p])
+            {
+                absorbing[p] = false;
+                work.push_back(p);
+            }
+        }
+    }
+    for (unsigned q = 0; q <= trap; ++q)
+    {
+        m_flags[q] |= (live[q] ? 0 : dead_flag) | (absorbing[q] ? absorbing_flag : 0);
+    }
+}
+
+unsigned DFA::transition(std::size_t index) const
+{
+    if (!m_table8.single.empty())
+    {
+        return m_table8.single[index];
+    }
+    if (!m_table16.single.empty())
+    {
+        return m_table16.single[index];
+    }
+    return m_table32.single[index];
 }
 
 void DFA::pclone(unsigned &s, uint_set &F, Rules_t &R, unsigned int offset) const
@@ -118,14 +619,19 @@ void DFA::pclone(unsigned &s, uint_set &F, Rules_t &R, unsigned int offset) cons
     F = m_F;
     F.rshift(offset);
     R.clear();
+    R.reserve(m_R.size());
     for (const auto &rule : m_R)
     {
-        R.push_back({rule.p + offset * 8, rule.a, rule.q + offset * 8});
+        R.push_back({rule.p + offset * 8, rule.a, rule.b, rule.q + offset * 8});
     }
 }
 
 void DFA::E(const Rules_t &R, uint_set &states)
 {
+    if (auto stats = current_stats())
+    {
+        ++stats->closure_calls;
+    }
     bool done = false;
     while (!done)
     {
@@ -144,38 +650,105 @@ void DFA::E(const Rules_t &R, uint_set &states)
 
 DFA DFA::from_NFA(unsigned s, const uint_set &F, const Rules_t &R)
 {
+    phase_scope phase(Phase::determinize);
+    auto stats = current_stats();
+    if (stats)
+    {
+        uint_set states({s});
+        unsigned num_states = 1;
+        for (const auto &rule : R)
+        {
+            for (auto q : {rule.p, rule.q})
+            {
+                if (!states.has(q))
+                {
+                    states.add(q);
+                    ++num_states;
+                }
+            }
+        }
+        ++stats->determinizations;
+        stats->nfa_states += num_states;
+        stats->nfa_rules += R.size();
+    }
+
     uint_set s_set({s});
     std::vector<uint_set> F_set;
     SRules_t R_set;
 
     DFA::E(R, s_set);
 
+    // cut the bytes into intervals on which every rule either applies or not
+    bool cut[257] = {};
+    for (const auto &rule : R)
+    {
+        if (rule.a != '\0')
+        {
+            cut[static_cast<unsigned char>(rule.a)] = true;
+            cut[static_cast<unsigned char>(rule.b) + 1] = true;
+        }
+    }
+    std::vector<unsigned> bounds; // interval i is [bounds[i], bounds[i + 1])
+    for (unsigned c = 0; c < 257; ++c)
+    {
+        if (cut[c])
+        {
+            bounds.push_back(c);
+        }
+    }
+
     std::vector<uint_set> to_do({s_set});
     std::vector<uint_set> done;
+    // (interval, state) for every move out of the current set, reused across iterations
+    std::vector<std::pair<unsigned, unsigned>> moves;
     while (to_do.size() > 0)
     {
-        uint_set p_set = to_do.back();
+        uint_set p_set = std::move(to_do.back());
         to_do.pop_back();
-        std::unordered_map<char, uint_set> cs;
+        if (stats)
+        {
+            ++stats->subset_iterations;
+        }
+        check_budget(done.size() + to_do.size() + 1);
+        moves.clear();
         for (const auto &rule : R)
         {
             if (rule.a != '\0' && p_set.has(rule.p))
             {
-                cs.emplace(rule.a, uint_set());
-                cs[rule.a].add(rule.q);
+                auto first = std::lower_bound(bounds.begin(), bounds.end(), static_cast<unsigned char>(rule.a));
+                auto last = std::lower_bound(first, bounds.end(), static_cast<unsigned char>(rule.b) + 1u);
+                for (auto it = first; it != last; ++it)
+                {
+                    moves.emplace_back(it - bounds.begin(), rule.q);
+                }
             }
         }
-        for (auto &kv : cs)
+        std::sort(moves.begin(), moves.end());
+        for (auto it = moves.begin(); it != moves.end();)
         {
-            auto &q_set = kv.second;
+            unsigned i = it->first;
+            uint_set q_set;
+            for (; it != moves.end() && it->first == i; ++it)
+            {
+                q_set.add(it->second);
+            }
             DFA::E(R, q_set);
-            R_set.emplace_back(p_set, kv.first, q_set);
+            // extend the previous rule over adjacent intervals that lead to the same set
+            char a = bounds[i];
+            char b = bounds[i + 1] - 1;
+            if (!R_set.empty() && R_set.back().p == p_set && R_set.back().q == q_set &&
+                static_cast<unsigned char>(R_set.back().b) + 1u == bounds[i])
+            {
+                R_set.back().b = b;
+                continue;
+            }
+            R_set.emplace_back(p_set, a, b, q_set);
             if (q_set != p_set && !in(q_set, to_do) && !in(q_set, done))
             {
-                to_do.push_back(q_set);
+                to_do.push_back(std::move(q_set));
             }
         }
-        done.push_back(p_set);
+        done.push_back(std::move(p_set));
     }
 
     for (const auto &st_set : done)
@@ -189,224 +762,723 @@ DFA DFA::from_NFA(unsigned s, const uint_set &F, const Rules_t &R)
     return DFA(s_set, F_set, R_set);
 }
 
-DFA DFA::from_regex(const char *regex)
+namespace
 {
-    DFA e(0, {0}, {{0, '\0', 0}});
-    if (*regex == '\0')
+
+/**
+ * A set of characters, i.e. bytes or, in UTF-8 mode, code points, as sorted disjoint intervals.
+ */
+class char_set
+{
+public:
+    typedef std::vector<std::pair<unsigned, unsigned>> Ranges_t;
+
+    char_set() = default;
+
+    char_set(unsigned a, unsigned b) : m_ranges({{a, b}})
     {
-        return e;
     }
-    std::vector<Operator> op_stack;
-    std::vector<DFA> v_stack;
-    bool is_last_dfa = false;
-    for (; *regex != '\0'; ++regex)
+
+    void add(unsigned a, unsigned b)
     {
-        switch (*regex)
-        {
-        case static_cast<char>(Operator::left_parenthesis):
+        m_ranges.emplace_back(a, b);
+        normalize();
+    }
+
+    void add(const char_set &other)
+    {
+        m_ranges.insert(m_ranges.end(), other.m_ranges.begin(), other.m_ranges.end());
+        normalize();
+    }
+
+    /**
+     * The characters in [1, @max] that are not in the set.
+     */
+    char_set complement(unsigned max) const
+    {
+        char_set result;
+        unsigned next = 1;
+        for (const auto &range : m_ranges)
         {
-            if (is_last_dfa)
+            if (range.first > next)
             {
-                op_stack.push_back(Operator::concatenation);
+                result.m_ranges.emplace_back(next, range.first - 1);
             }
-            op_stack.push_back(Operator::left_parenthesis);
-            is_last_dfa = false;
+            next = std::max(next, range.second + 1);
         }
-        break;
-        case static_cast<char>(Operator::right_parenthesis):
+        if (next <= max)
         {
-            if (op_stack.size() > 0 && op_stack.back() == Operator::left_parenthesis)
-            {
-                v_stack.push_back(e);
-            }
-            while (op_stack.size() > 0 && op_stack.back() != Operator::left_parenthesis)
-            {
-                DFA::_eval(op_stack.back(), v_stack);
-                op_stack.pop_back();
-            }
-            if (op_stack.size() > 0 && op_stack.back() == Operator::left_parenthesis)
+            result.m_ranges.emplace_back(next, max);
+        }
+        return result;
+    }
+
+    const Ranges_t &ranges() const
+    {
+        return m_ranges;
+    }
+
+    unsigned max() const
+    {
+        return m_ranges.empty() ? 0 : m_ranges.back().second;
+    }
+
+private:
+    void normalize()
+    {
+        std::sort(m_ranges.begin(), m_ranges.end());
+        Ranges_t merged;
+        for (const auto &range : m_ranges)
+        {
+            if (!merged.empty() && range.first <= merged.back().second + 1)
             {
-                op_stack.pop_back();
+                merged.back().second = std::max(merged.back().second, range.second);
             }
             else
             {
-                throw ParsingException("missing left parenthesis '('");
-            }
-        }
-        break;
-        case static_cast<char>(Operator::alternation):
-        {
-            while (op_stack.size() > 0 && (op_stack.back() == Operator::kleene_star || op_stack.back() == Operator::concatenation))
-            {
-                DFA::_eval(op_stack.back(), v_stack);
-                op_stack.pop_back();
+                merged.push_back(range);
             }
-            op_stack.push_back(Operator::alternation);
-            is_last_dfa = false;
         }
-        break;
-        case static_cast<char>(Operator::kleene_star):
-        {
-            op_stack.push_back(Operator::kleene_star);
-        }
-        break;
-        default:
+        m_ranges.swap(merged);
+    }
+
+    Ranges_t m_ranges;
+};
+
+const unsigned max_code_point = 0x10FFFF;
+
+bool is_surrogate(unsigned c)
+{
+    return c >= 0xD800 && c <= 0xDFFF;
+}
+
+/**
+ * The characters not in @set: bytes but '\0', or in UTF-8 mode code points but '\0' and surrogates.
+ */
+char_set negate(const char_set &set, const compile_options &options)
+{
+    if (!options.utf8)
+    {
+        return set.complement(0xFF);
+    }
+    auto with_surrogates = set;
+    with_surrogates.add(0xD800, 0xDFFF);
+    return with_surrogates.complement(max_code_point);
+}
+
+const unicode::fold ascii_folds[] = {{'A', 'Z', 'a' - 'A'}, {'a', 'z', 'A' - 'a'}};
+
+/**
+ * Add to @set the other cases of its characters: of ASCII letters, or in UTF-8 mode of every
+ * code point with a simple case folding. Folding happens on the set, before any negation,
+ * so a case-insensitive pattern has the transitions, and the states, of the case-sensitive one.
+ */
+void fold_case(char_set &set, const compile_options &options)
+{
+    if (!options.case_insensitive)
+    {
+        return;
+    }
+    const unicode::fold *first = ascii_folds;
+    const unicode::fold *last = std::end(ascii_folds);
+    if (options.utf8)
+    {
+        first = unicode::folds;
+        last = std::end(unicode::folds);
+    }
+
+    // each pass maps every character to the next one in its orbit, until no case is missing
+    for (bool changed = true; changed;)
+    {
+        char_set other;
+        for (const auto &range : set.ranges())
         {
-            auto dfa = DFA(0, {1}, {{0, *regex, 1}});
-            if (is_last_dfa)
+            auto it = std::lower_bound(first, last, range.first, [](const unicode::fold &f, unsigned c) {
+                return f.last < c;
+            });
+            for (; it != last && it->first <= range.second; ++it)
             {
-                while (op_stack.size() > 0 && op_stack.back() == Operator::kleene_star)
+                unsigned a = std::max(range.first, it->first);
+                unsigned b = std::min(range.second, it->last);
+                if (it->delta == unicode::even_odd)
                 {
-                    DFA::_eval(op_stack.back(), v_stack);
-                    op_stack.pop_back();
+                    // every character's neighbour, which covers [a, b] and may extend it by one
+                    other.add(a - (a - it->first) % 2, b + 1 - (b - it->first) % 2);
+                }
+                else
+                {
+                    other.add(a + it->delta, b + it->delta);
                 }
-                op_stack.push_back(Operator::concatenation);
             }
-            v_stack.push_back(dfa);
-            is_last_dfa = true;
-        }
-        break;
         }
+        auto before = set.ranges();
+        set.add(other);
+        changed = set.ranges() != before;
     }
+}
 
-    while (op_stack.size() > 0)
+/**
+ * Decode the UTF-8 sequence @regex points to, leaving @regex on its last byte.
+ */
+unsigned decode_utf8(const char *&regex)
+{
+    auto bytes = reinterpret_cast<const unsigned char *>(regex);
+    unsigned c = bytes[0];
+    unsigned n = 0;
+    if (c < 0x80)
     {
-        if (op_stack.back() == Operator::left_parenthesis)
+        return c;
+    }
+    else if ((c & 0xE0) == 0xC0)
+    {
+        c &= 0x1F;
+        n = 1;
+    }
+    else if ((c & 0xF0) == 0xE0)
+    {
+        c &= 0x0F;
+        n = 2;
+    }
+    else if ((c & 0xF8) == 0xF0)
+    {
+        c &= 0x07;
+        n = 3;
+    }
+    else
+    {
+        throw ParsingException("invalid UTF-8 in pattern");
+    }
+    for (unsigned i = 1; i <= n; ++i)
+    {
+        if ((bytes[i] & 0xC0) != 0x80)
         {
-            throw ParsingException("missing right parenthesis ')'");
+            throw ParsingException("invalid UTF-8 in pattern");
         }
-        DFA::_eval(op_stack.back(), v_stack);
-        op_stack.pop_back();
+        c = (c << 6) | (bytes[i] & 0x3F);
+    }
+    // reject overlong encodings
+    const unsigned min[] = {0, 0x80, 0x800, 0x10000};
+    if (c < min[n] || c > max_code_point || is_surrogate(c))
+    {
+        throw ParsingException("invalid UTF-8 in pattern");
     }
+    regex += n;
+    return c;
+}
 
-    return v_stack.back();
+/**
+ * The character @regex points to, leaving @regex on its last byte.
+ */
+unsigned read_char(const char *&regex, const compile_options &options)
+{
+    return options.utf8 ? decode_utf8(regex) : static_cast<unsigned char>(*regex);
 }
 
-void DFA::reset()
+int hex_digit(char c)
 {
-    m_state = m_s;
-    m_trapped = false;
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
 }
 
-void DFA::advance(char a)
+/**
+ * Parse the hexadecimal escape whose 'x' @regex points to: \xHH or \x{H...}.
+ */
+unsigned parse_hex(const char *&regex, const compile_options &options)
 {
-    for (const auto &rule : m_R)
+    unsigned c = 0;
+    if (regex[1] == '{')
     {
-        if (rule.p == m_state && rule.a == a)
+        regex += 2;
+        const char *first = regex;
+        for (; hex_digit(*regex) >= 0 && regex - first < 6; ++regex)
         {
-            m_state = rule.q;
-            return;
+            c = c * 16 + hex_digit(*regex);
+        }
+        if (regex == first || *regex != '}')
+        {
+            throw ParsingException("invalid hexadecimal escape, expected '\\x{H...}'");
+        }
+    }
+    else
+    {
+        if (hex_digit(regex[1]) < 0 || hex_digit(regex[2]) < 0)
+        {
+            throw ParsingException("invalid hexadecimal escape, expected '\\xHH'");
         }
+        c = hex_digit(regex[1]) * 16 + hex_digit(regex[2]);
+        regex += 2;
     }
-    m_trapped = true;
+    if (c == 0 || c > (options.utf8 ? max_code_point : 0xFF) || (options.utf8 && is_surrogate(c)))
+    {
+        throw ParsingException("hexadecimal escape out of range");
+    }
+    return c;
 }
 
-bool DFA::operator()(const char *tape)
+/**
+ * Parse the Unicode category whose 'p' or 'P' @regex points to: \pL or \p{Nd}.
+ */
+char_set parse_category(const char *&regex, const compile_options &options)
 {
-    reset();
-    while (*tape != '\0')
+    if (!options.utf8)
     {
-        advance(*tape);
-        if (m_trapped)
+        throw ParsingException("'\\p' requires UTF-8 mode");
+    }
+    bool negated = *regex == 'P';
+    std::string name;
+    if (regex[1] == '{')
+    {
+        regex += 2;
+        for (; *regex != '}'; ++regex)
         {
-            return false;
+            if (*regex == '\0')
+            {
+                throw ParsingException("missing right brace '}'");
+            }
+            name += *regex;
         }
-        ++tape;
     }
-    return m_F.has(m_state);
+    else if (regex[1] != '\0')
+    {
+        name = *++regex;
+    }
+
+    for (const auto &category : unicode::categories)
+    {
+        if (name == category.name)
+        {
+            char_set set;
+            for (unsigned i = 0; i < category.size; ++i)
+            {
+                set.add(category.ranges[i].first, category.ranges[i].last);
+            }
+            return negated ? negate(set, options) : set;
+        }
+    }
+    throw ParsingException("unknown Unicode category");
 }
 
-bool DFA::match(const char *string)
+/**
+ * Parse the escape sequence whose backslash @regex points to, leaving @regex on its last character.
+ * Return the character it stands for, or -1 after adding the characters of a class such as \d to @set.
+ */
+int parse_escape(const char *&regex, char_set &set, const compile_options &options)
 {
-    return this->operator()(string);
+    char c = *++regex;
+    switch (c)
+    {
+    case '\0':
+        throw ParsingException("trailing backslash '\\'");
+    case 'n':
+        return '\n';
+    case 't':
+        return '\t';
+    case 'r':
+        return '\r';
+    case 'f':
+        return '\f';
+    case 'v':
+        return '\v';
+    case 'x':
+        return parse_hex(regex, options);
+    case 'p':
+    case 'P':
+        set.add(parse_category(regex, options));
+        return -1;
+    case 'd':
+    case 'D':
+    case 'w':
+    case 'W':
+    case 's':
+    case 'S':
+    {
+        char_set ascii;
+        if (c == 'd' || c == 'D' || c == 'w' || c == 'W')
+        {
+            ascii.add('0', '9');
+        }
+        if (c == 'w' || c == 'W')
+        {
+            ascii.add('a', 'z');
+            ascii.add('A', 'Z');
+            ascii.add('_', '_');
+        }
+        if (c == 's' || c == 'S')
+        {
+            ascii.add('\t', '\r'); // \t \n \v \f \r
+            ascii.add(' ', ' ');
+        }
+        set.add((c == 'D' || c == 'W' || c == 'S') ? negate(ascii, options) : ascii);
+        return -1;
+    }
+    default:
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+        {
+            throw ParsingException("unknown escape sequence");
+        }
+        return read_char(regex, options);
+    }
 }
 
-DFA DFA::kleene_star() const
+/**
+ * Parse the bracket expression whose '[' @regex points to, leaving @regex on its ']'.
+ */
+char_set parse_class(const char *&regex, const compile_options &options)
 {
-    unsigned s = m_R.size() * 2 + 1;
-    auto F = m_F | uint_set({s});
-    auto R = m_R;
-    for (const auto &f : F)
+    char_set set;
+    bool negated = *++regex == '^';
+    if (negated)
     {
-        R.push_back({f, '\0', m_s});
+        ++regex;
+    }
+    // a ']' right after the '[' or '[^' is a literal
+    for (bool first = true; first || *regex != ']'; ++regex, first = false)
+    {
+        if (*regex == '\0')
+        {
+            throw ParsingException("missing right bracket ']'");
+        }
+        int a = *regex == '\\' ? parse_escape(regex, set, options) : read_char(regex, options);
+        if (a < 0)
+        {
+            continue;
+        }
+        int b = a;
+        if (regex[1] == '-' && regex[2] != ']' && regex[2] != '\0')
+        {
+            regex += 2;
+            b = *regex == '\\' ? parse_escape(regex, set, options) : read_char(regex, options);
+            if (b < a)
+            {
+                throw ParsingException("invalid range in bracket expression");
+            }
+        }
+        set.add(a, b);
     }
+    fold_case(set, options);
+    return negated ? negate(set, options) : set;
+}
 
-    return DFA::from_NFA(s, F, R);
+/**
+ * Parse the literal character @regex points to, leaving @regex on its last byte.
+ */
+char_set parse_literal(const char *&regex, const compile_options &options)
+{
+    char_set set;
+    unsigned c = read_char(regex, options);
+    set.add(c, c);
+    fold_case(set, options);
+    return set;
 }
 
-DFA DFA::concatenation(const DFA &other) const
+/**
+ * Parse the single-character expression @regex points to (a literal, '.', an escape sequence
+ * or a bracket expression), leaving @regex on its last byte.
+ */
+char_set parse_atom(const char *&regex, const compile_options &options)
 {
-    unsigned s_other;
-    uint_set F_other;
-    Rules_t R_other;
-    other.pclone(s_other, F_other, R_other, m_num_states / 8 + 1);
+    if (options.basic_syntax)
+    {
+        return parse_literal(regex, options);
+    }
+    char_set set;
+    switch (*regex)
+    {
+    case '.':
+        set = negate({'\n', '\n'}, options);
+        break;
+    case '[':
+        set = parse_class(regex, options);
+        break;
+    case '\\':
+    {
+        int c = parse_escape(regex, set, options);
+        if (c >= 0)
+        {
+            set.add(c, c);
+        }
+        fold_case(set, options);
+        break;
+    }
+    default:
+        set = parse_literal(regex, options);
+        break;
+    }
+    return set;
+}
 
-    auto s = m_s;
-    auto F = F_other;
-    auto R = m_R;
-    R.insert(R.end(), R_other.begin(), R_other.end());
-    for (const auto &f : m_F)
+const unsigned max_repetition = 1000;
+
+unsigned parse_count(const char *&regex)
+{
+    if (*regex < '0' || *regex > '9')
     {
-        R.push_back({f, '\0', s_other});
+        throw ParsingException("invalid repetition, expected '{n}', '{n,}' or '{n,m}'");
     }
+    unsigned n = 0;
+    for (; *regex >= '0' && *regex <= '9'; ++regex)
+    {
+        n = n * 10 + (*regex - '0');
+        if (n > max_repetition)
+        {
+            throw ParsingException("repetition count too large");
+        }
+    }
+    return n;
+}
 
-    return DFA::from_NFA(s, F, R);
+/**
+ * Parse the counted repetition whose '{' @regex points to, leaving @regex on its '}'.
+ */
+void parse_bounds(const char *&regex, unsigned &min, unsigned &max)
+{
+    ++regex;
+    min = max = parse_count(regex);
+    if (*regex == ',')
+    {
+        ++regex;
+        max = *regex == '}' ? DFA::unbounded : parse_count(regex);
+    }
+    if (*regex != '}')
+    {
+        throw ParsingException("invalid repetition, expected '{n}', '{n,}' or '{n,m}'");
+    }
+    if (max < min)
+    {
+        throw ParsingException("invalid repetition, the maximum is less than the minimum");
+    }
 }
 
-DFA DFA::alternation(const DFA &other) const
+/**
+ * A DFA accepting the single bytes in @set, with one rule per range.
+ */
+DFA from_bytes(const char_set &set)
 {
-    unsigned s_other;
-    uint_set F_other;
-    Rules_t R_other;
-    other.pclone(s_other, F_other, R_other, m_num_states / 8 + 1);
+    DFA::Rules_t R;
+    for (const auto &range : set.ranges())
+    {
+        R.emplace_back(0, static_cast<char>(range.first), static_cast<char>(range.second), 1);
+    }
+    return DFA(0, {1}, R);
+}
 
-    unsigned s = other.m_num_states + (m_num_states / 8 + 1) * 8 + 1;
-    auto F = m_F | F_other;
-    auto R = m_R;
-    R.insert(R.end(), R_other.begin(), R_other.end());
-    R.emplace_back(s, '\0', m_s);
-    R.emplace_back(s, '\0', s_other);
+typedef std::pair<unsigned char, unsigned char> byte_range;
 
-    return DFA::from_NFA(s, F, R);
+unsigned encode_utf8(unsigned c, unsigned char *bytes)
+{
+    if (c < 0x80)
+    {
+        bytes[0] = c;
+        return 1;
+    }
+    unsigned n = c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+    for (unsigned i = n - 1; i > 0; --i)
+    {
+        bytes[i] = 0x80 | (c & 0x3F);
+        c >>= 6;
+    }
+    bytes[0] = (0xF00 >> n) | c;
+    return n;
 }
 
-void DFA::_eval(Operator op, std::vector<DFA> &v_stack) throw()
+/**
+ * Append the sequences of byte ranges whose UTF-8 encodings are exactly the code points in [a, b].
+ */
+void utf8_sequences(unsigned a, unsigned b, std::vector<std::vector<byte_range>> &sequences)
 {
-    switch (op)
-    {
-    case Operator::kleene_star:
+    // split where the encoding length changes
+    for (unsigned bound : {0x7Fu, 0x7FFu, 0xFFFFu})
     {
-        if (v_stack.size() < 1)
+        if (a <= bound && bound < b)
         {
-            throw ParsingException("missing operand for operator '*'");
+            utf8_sequences(a, bound, sequences);
+            utf8_sequences(bound + 1, b, sequences);
+            return;
         }
-        v_stack.back() = v_stack.back().kleene_star();
-        break;
     }
-    case Operator::concatenation:
+    // and where a leading byte changes before the trailing bytes have covered their whole range
+    for (unsigned i = 1; i < 4; ++i)
     {
-        if (v_stack.size() < 2)
+        unsigned m = (1u << (6 * i)) - 1;
+        if ((a & ~m) != (b & ~m))
         {
-            throw ParsingException("missing operand for operator '|'");
+            if ((a & m) != 0)
+            {
+                utf8_sequences(a, a | m, sequences);
+                utf8_sequences((a | m) + 1, b, sequences);
+                return;
+            }
+            if ((b & m) != m)
+            {
+                utf8_sequences(a, (b & ~m) - 1, sequences);
+                utf8_sequences(b & ~m, b, sequences);
+                return;
+            }
         }
-        auto rhs = v_stack.back();
-        v_stack.pop_back();
-        auto lhs = v_stack.back();
-        v_stack.pop_back();
-        v_stack.push_back(lhs.concatenation(rhs));
-        break;
     }
-    case Operator::alternation:
+    unsigned char first[4];
+    unsigned char last[4];
+    unsigned n = encode_utf8(a, first);
+    encode_utf8(b, last);
+    sequences.emplace_back();
+    for (unsigned i = 0; i < n; ++i)
     {
-        if (v_stack.size() < 2)
+        sequences.back().emplace_back(first[i], last[i]);
+    }
+}
+
+typedef std::vector<std::pair<byte_range, unsigned>> Edges_t;
+
+/**
+ * The trie of the UTF-8 encodings of the code points in @set, as the byte-range edges of each
+ * node; the root is node 0, children come after their parents and leaves have no edges.
+ */
+std::vector<Edges_t> utf8_trie(const char_set &set)
+{
+    std::vector<std::vector<byte_range>> sequences;
+    for (const auto &range : set.ranges())
+    {
+        utf8_sequences(range.first, range.second, sequences);
+    }
+
+    // the sequences are split so that sibling edges are equal or disjoint,
+    // and UTF-8 is prefix-free, so every sequence ends at its own leaf
+    std::vector<Edges_t> trie(1);
+    for (const auto &sequence : sequences)
+    {
+        unsigned node = 0;
+        for (const auto &range : sequence)
+        {
+            auto &edges = trie[node];
+            auto it = std::find_if(edges.begin(), edges.end(), [&](const std::pair<byte_range, unsigned> &edge) {
+                return edge.first == range;
+            });
+            if (it != edges.end())
+            {
+                node = it->second;
+                continue;
+            }
+            edges.emplace_back(range, trie.size());
+            node = trie.size();
+            trie.emplace_back();
+        }
+    }
+    return trie;
+}
+
+/**
+ * A DFA accepting the UTF-8 encodings of the code points in @set.
+ * The byte sequences go into a trie whose common suffixes are then merged,
+ * which gives the minimal DFA without a subset construction.
+ */
+DFA from_code_points(const char_set &set)
+{
+    // ASCII-only sets need no multi-byte sequences
+    if (set.max() < 0x80)
+    {
+        return from_bytes(set);
+    }
+
+    auto trie = utf8_trie(set);
+
+    // nodes are created after their parents, so walking backwards merges children first
+    std::map<Edges_t, unsigned> state_of;
+    std::vector<unsigned> state(trie.size());
+    for (unsigned i = trie.size(); i-- > 0;)
+    {
+        Edges_t edges = trie[i];
+        for (auto &edge : edges)
+        {
+            edge.second = state[edge.second];
+        }
+        std::sort(edges.begin(), edges.end());
+        state[i] = state_of.emplace(edges, state_of.size()).first->second;
+    }
+
+    DFA::Rules_t R;
+    for (const auto &kv : state_of)
+    {
+        for (const auto &edge : kv.first)
+        {
+            R.emplace_back(kv.second, static_cast<char>(edge.first.first), static_cast<char>(edge.first.second), edge.second);
+        }
+    }
+    return DFA(state[0], {state_of[Edges_t()]}, R);
+}
+
+DFA from_chars(const char_set &set, const compile_options &options)
+{
+    return options.utf8 ? from_code_points(set) : from_bytes(set);
+}
+
+/**
+ * Add the rules of state @p, which moves to @targets[@class_of[c]] on byte c (or to the trap if
+ * that is @trap), one rule per run of bytes with the same target.
+ */
+template <class Classes>
+void add_rules(DFA::Rules_t &R, unsigned p, const Classes &class_of, const std::vector<unsigned> &targets, unsigned trap)
+{
+    for (unsigned a = 1; a < 256;)
+    {
+        unsigned q = targets[class_of[a]];
+        unsigned b = a;
+        while (b + 1 < 256 && targets[class_of[b + 1]] == q)
+        {
+            ++b;
+        }
+        if (q != trap)
+        {
+            R.emplace_back(p, static_cast<char>(a), static_cast<char>(b), q);
+        }
+        a = b + 1;
+    }
+}
+
+/**
+ * Apply @op to the operands on top of @v_stack, replacing them with the result.
+ */
+template <class Builder>
+void eval(DFA::Operator op, std::vector<typename Builder::value_type> &v_stack, Builder &builder)
+{
+    switch (op)
+    {
+    case DFA::Operator::kleene_star:
+    {
+        if (v_stack.size() < 1)
+        {
+            throw ParsingException("missing operand for operator '*'");
+        }
+        v_stack.back() = builder.kleene_star(std::move(v_stack.back()));
+        break;
+    }
+    case DFA::Operator::concatenation:
+    case DFA::Operator::alternation:
+    {
+        if (v_stack.size() < 2)
         {
             throw ParsingException("missing operand for operator '|'");
         }
-        auto rhs = v_stack.back();
+        auto rhs = std::move(v_stack.back());
         v_stack.pop_back();
-        auto lhs = v_stack.back();
-        v_stack.pop_back();
-        v_stack.push_back(lhs.alternation(rhs));
+        if (op == DFA::Operator::concatenation)
+        {
+            v_stack.back() = builder.concatenation(std::move(v_stack.back()), std::move(rhs));
+        }
+        else
+        {
+            v_stack.back() = builder.alternation(std::move(v_stack.back()), std::move(rhs));
+        }
         break;
     }
     default:
@@ -415,4 +1487,2993 @@ void DFA::_eval(Operator op, std::vector<DFA> &v_stack) throw()
     }
 }
 
+/**
+ * Parse @regex with the shunting-yard algorithm. @builder makes the operands and applies the
+ * operators to them: it has a value_type and the members empty(), chars(set), kleene_star(x),
+ * concatenation(x, y), alternation(x, y), repeat(x, min, max) and group(x, index), the last
+ * called on each parenthesized operand with the number of its '(' counting from 1.
+ */
+template <class Builder>
+typename Builder::value_type parse(const char *regex, const compile_options &options, Builder &builder)
+{
+    typedef DFA::Operator Operator;
+    if (*regex == '\0')
+    {
+        return builder.empty();
+    }
+    std::vector<Operator> op_stack;
+    std::vector<typename Builder::value_type> v_stack;
+    std::vector<unsigned> groups;
+    unsigned num_groups = 0;
+    bool is_last_dfa = false;
+    auto push_operand = [&](const char_set &set) {
+        auto operand = builder.chars(set);
+        if (is_last_dfa)
+        {
+            op_stack.push_back(Operator::concatenation);
+        }
+        v_stack.push_back(std::move(operand));
+        is_last_dfa = true;
+    };
+    for (; *regex != '\0'; ++regex)
+    {
+        switch (*regex)
+        {
+        case static_cast<char>(Operator::left_parenthesis):
+        {
+            if (is_last_dfa)
+            {
+                op_stack.push_back(Operator::concatenation);
+            }
+            op_stack.push_back(Operator::left_parenthesis);
+            groups.push_back(++num_groups);
+            is_last_dfa = false;
+        }
+        break;
+        case static_cast<char>(Operator::right_parenthesis):
+        {
+            if (!is_last_dfa && op_stack.size() > 0 && op_stack.back() == Operator::left_parenthesis)
+            {
+                v_stack.push_back(builder.empty());
+            }
+            while (op_stack.size() > 0 && op_stack.back() != Operator::left_parenthesis)
+            {
+                eval(op_stack.back(), v_stack, builder);
+                op_stack.pop_back();
+            }
+            if (op_stack.size() > 0 && op_stack.back() == Operator::left_parenthesis)
+            {
+                op_stack.pop_back();
+            }
+            else
+            {
+                throw ParsingException("missing left parenthesis '('");
+            }
+            v_stack.back() = builder.group(std::move(v_stack.back()), groups.back());
+            groups.pop_back();
+            is_last_dfa = true;
+        }
+        break;
+        case static_cast<char>(Operator::alternation):
+        {
+            while (op_stack.size() > 0 && op_stack.back() == Operator::concatenation)
+            {
+                eval(op_stack.back(), v_stack, builder);
+                op_stack.pop_back();
+            }
+            op_stack.push_back(Operator::alternation);
+            is_last_dfa = false;
+        }
+        break;
+        case static_cast<char>(Operator::kleene_star):
+        {
+            // postfix and binding tightest, so it applies to the last operand right away
+            if (!is_last_dfa)
+            {
+                throw ParsingException("missing operand for operator '*'");
+            }
+            eval(Operator::kleene_star, v_stack, builder);
+        }
+        break;
+        case '+':
+        case '?':
+        case '{':
+        {
+            if (options.basic_syntax)
+            {
+                push_operand(parse_literal(regex, options));
+                break;
+            }
+            if (!is_last_dfa)
+            {
+                throw ParsingException("missing operand for repetition");
+            }
+            unsigned min = *regex == '+';
+            unsigned max = *regex == '?' ? 1 : DFA::unbounded;
+            if (*regex == '{')
+            {
+                parse_bounds(regex, min, max);
+            }
+            v_stack.back() = builder.repeat(std::move(v_stack.back()), min, max);
+        }
+        break;
+        default:
+            push_operand(parse_atom(regex, options));
+            break;
+        }
+    }
+
+    while (op_stack.size() > 0)
+    {
+        if (op_stack.back() == Operator::left_parenthesis)
+        {
+            throw ParsingException("missing right parenthesis ')'");
+        }
+        eval(op_stack.back(), v_stack, builder);
+        op_stack.pop_back();
+    }
+
+    return std::move(v_stack.back());
+}
+
+/**
+ * Interns the structure of operands, so that equal subexpressions get the same key.
+ * Alternatives are ordered, alternation being commutative.
+ */
+class key_builder
+{
+public:
+    typedef unsigned value_type;
+
+    unsigned empty()
+    {
+        return intern({static_cast<unsigned>(Node::empty)});
+    }
+
+    unsigned chars(const char_set &set)
+    {
+        std::vector<unsigned> node{static_cast<unsigned>(Node::chars)};
+        for (const auto &range : set.ranges())
+        {
+            node.push_back(range.first);
+            node.push_back(range.second);
+        }
+        return intern(std::move(node));
+    }
+
+    unsigned kleene_star(unsigned x)
+    {
+        return intern({static_cast<unsigned>(Node::kleene_star), x});
+    }
+
+    unsigned concatenation(unsigned x, unsigned y)
+    {
+        return intern({static_cast<unsigned>(Node::concatenation), x, y});
+    }
+
+    unsigned alternation(unsigned x, unsigned y)
+    {
+        return intern({static_cast<unsigned>(Node::alternation), std::min(x, y), std::max(x, y)});
+    }
+
+    unsigned repeat(unsigned x, unsigned min, unsigned max)
+    {
+        return intern({static_cast<unsigned>(Node::repeat), x, min, max});
+    }
+
+    unsigned group(unsigned x, unsigned)
+    {
+        return x;
+    }
+
+    /**
+     * How many times each key has been built.
+     */
+    const std::vector<unsigned> &uses() const
+    {
+        return m_uses;
+    }
+
+private:
+    enum class Node : unsigned
+    {
+        empty,
+        chars,
+        kleene_star,
+        concatenation,
+        alternation,
+        repeat,
+    };
+
+    unsigned intern(std::vector<unsigned> &&node)
+    {
+        // the second pass over the pattern finds every key, without allocating a map node
+        auto it = m_ids.find(node);
+        if (it == m_ids.end())
+        {
+            it = m_ids.emplace(std::move(node), m_uses.size()).first;
+            m_uses.push_back(0);
+        }
+        ++m_uses[it->second];
+        return it->second;
+    }
+
+    std::map<std::vector<unsigned>, unsigned> m_ids;
+    std::vector<unsigned> m_uses;
+};
+
+/**
+ * Builds each operand as a DFA, determinizing after every operator. Subexpressions that
+ * occur more than once in the pattern, as counted by a first pass over it with the same
+ * key_builder, are built once and copied after that.
+ */
+class dfa_builder
+{
+public:
+    struct value_type
+    {
+        unsigned key;
+        DFA dfa;
+    };
+
+    dfa_builder(const compile_options &options, key_builder &keys)
+        : m_options(options), m_keys(keys), m_repeated(keys.uses())
+    {
+    }
+
+    value_type empty()
+    {
+        return build(m_keys.empty(), []() { return DFA(0, {0}, {{0, '\0', 0}}); });
+    }
+
+    value_type chars(const char_set &set)
+    {
+        return build(m_keys.chars(set), [&]() { return from_chars(set, m_options); });
+    }
+
+    value_type kleene_star(value_type &&x)
+    {
+        return build(m_keys.kleene_star(x.key), [&]() {
+            phase_scope phase(Phase::construct);
+            return std::move(x.dfa).kleene_star();
+        });
+    }
+
+    value_type concatenation(value_type &&x, value_type &&y)
+    {
+        return build(m_keys.concatenation(x.key, y.key), [&]() {
+            phase_scope phase(Phase::construct);
+            return std::move(x.dfa).concatenation(y.dfa);
+        });
+    }
+
+    value_type alternation(value_type &&x, value_type &&y)
+    {
+        return build(m_keys.alternation(x.key, y.key), [&]() {
+            phase_scope phase(Phase::construct);
+            return std::move(x.dfa).alternation(y.dfa);
+        });
+    }
+
+    value_type repeat(value_type &&x, unsigned min, unsigned max)
+    {
+        return build(m_keys.repeat(x.key, min, max), [&]() {
+            phase_scope phase(Phase::construct);
+            return x.dfa.repeat(min, max);
+        });
+    }
+
+    value_type group(value_type &&x, unsigned)
+    {
+        return std::move(x);
+    }
+
+private:
+    template <class F>
+    value_type build(unsigned key, F f)
+    {
+        auto it = m_shared.find(key);
+        if (it != m_shared.end())
+        {
+            if (auto stats = current_stats())
+            {
+                ++stats->shared_subexpressions;
+            }
+            return {key, it->second};
+        }
+        value_type value{key, f()};
+        if (m_repeated[key] > 1)
+        {
+            m_shared.emplace(key, value.dfa);
+        }
+        return value;
+    }
+
+    const compile_options &m_options;
+    key_builder &m_keys;
+    const std::vector<unsigned> m_repeated;
+    std::map<unsigned, DFA> m_shared;
+};
+
+/**
+ * Regular expressions over bytes as hash-consed terms: structurally equal terms share one id.
+ * The constructors normalize as they go (alternations are flat, sorted and duplicate-free,
+ * with their byte sets merged; concatenations nest to the right; the empty set and the empty
+ * string are absorbed), so that derivatives of a term keep meeting the same few terms.
+ */
+class term_store
+{
+public:
+    typedef std::bitset<256> Bytes_t;
+
+    term_store()
+    {
+        m_nothing = intern({Kind::nothing, {}, {}, false});
+        m_empty = intern({Kind::empty, {}, {}, true});
+    }
+
+    /**
+     * The term matching nothing, i.e. the empty language.
+     */
+    unsigned nothing() const
+    {
+        return m_nothing;
+    }
+
+    /**
+     * The term matching only the empty string.
+     */
+    unsigned empty() const
+    {
+        return m_empty;
+    }
+
+    unsigned bytes(const Bytes_t &set)
+    {
+        return set.none() ? m_nothing : intern({Kind::bytes, {}, set, false});
+    }
+
+    unsigned concatenation(unsigned x, unsigned y)
+    {
+        if (x == m_nothing || y == m_nothing)
+        {
+            return m_nothing;
+        }
+        if (x == m_empty)
+        {
+            return y;
+        }
+        if (y == m_empty)
+        {
+            return x;
+        }
+        if (m_terms[x].kind == Kind::concatenation)
+        {
+            unsigned head = m_terms[x].children[0];
+            unsigned tail = m_terms[x].children[1];
+            return concatenation(head, concatenation(tail, y));
+        }
+        return intern({Kind::concatenation, {x, y}, {}, m_terms[x].nullable && m_terms[y].nullable});
+    }
+
+    unsigned alternation(const std::vector<unsigned> &xs)
+    {
+        std::vector<unsigned> children;
+        Bytes_t bytes;
+        for (auto x : xs)
+        {
+            const auto &t = m_terms[x];
+            if (t.kind == Kind::alternation)
+            {
+                // already normalized, so none of its children are alternations
+                for (auto child : t.children)
+                {
+                    if (m_terms[child].kind == Kind::bytes)
+                    {
+                        bytes |= m_terms[child].bytes;
+                    }
+                    else
+                    {
+                        children.push_back(child);
+                    }
+                }
+            }
+            else if (t.kind == Kind::bytes)
+            {
+                bytes |= t.bytes;
+            }
+            else if (x != m_nothing)
+            {
+                children.push_back(x);
+            }
+        }
+        if (bytes.any())
+        {
+            children.push_back(this->bytes(bytes));
+        }
+        std::sort(children.begin(), children.end());
+        children.erase(std::unique(children.begin(), children.end()), children.end());
+        if (children.empty())
+        {
+            return m_nothing;
+        }
+        if (children.size() == 1)
+        {
+            return children[0];
+        }
+        bool nullable = std::any_of(children.begin(), children.end(), [&](unsigned child) {
+            return m_terms[child].nullable;
+        });
+        return intern({Kind::alternation, std::move(children), {}, nullable});
+    }
+
+    unsigned kleene_star(unsigned x)
+    {
+        if (x == m_nothing || x == m_empty)
+        {
+            return m_empty;
+        }
+        if (m_terms[x].kind == Kind::kleene_star)
+        {
+            return x;
+        }
+        return intern({Kind::kleene_star, {x}, {}, true});
+    }
+
+    bool nullable(unsigned x) const
+    {
+        return m_terms[x].nullable;
+    }
+
+    /**
+     * The byte sets of all terms so far.
+     */
+    std::vector<Bytes_t> byte_sets() const
+    {
+        std::vector<Bytes_t> sets;
+        for (const auto &t : m_terms)
+        {
+            if (t.kind == Kind::bytes)
+            {
+                sets.push_back(t.bytes);
+            }
+        }
+        return sets;
+    }
+
+    /**
+     * The derivative of @x by @byte: the term matching the rest of the strings of @x
+     * that start with @byte. Memoized, so callers should query one byte per byte class.
+     */
+    unsigned derivative(unsigned x, unsigned char byte)
+    {
+        auto key = static_cast<unsigned long long>(x) << 8 | byte;
+        auto it = m_derivatives.find(key);
+        if (it != m_derivatives.end())
+        {
+            return it->second;
+        }
+
+        unsigned d = m_nothing;
+        // copy the children, the vector of terms may grow below
+        auto children = m_terms[x].children;
+        switch (m_terms[x].kind)
+        {
+        case Kind::nothing:
+        case Kind::empty:
+            break;
+        case Kind::bytes:
+            d = m_terms[x].bytes[byte] ? m_empty : m_nothing;
+            break;
+        case Kind::concatenation:
+        {
+            d = concatenation(derivative(children[0], byte), children[1]);
+            if (m_terms[children[0]].nullable)
+            {
+                d = alternation({d, derivative(children[1], byte)});
+            }
+            break;
+        }
+        case Kind::alternation:
+        {
+            for (auto &child : children)
+            {
+                child = derivative(child, byte);
+            }
+            d = alternation(children);
+            break;
+        }
+        case Kind::kleene_star:
+            d = concatenation(derivative(children[0], byte), x);
+            break;
+        }
+        m_derivatives.emplace(key, d);
+        return d;
+    }
+
+private:
+    enum class Kind : char
+    {
+        nothing,
+        empty,
+        bytes,
+        concatenation,
+        alternation,
+        kleene_star,
+    };
+
+    struct term
+    {
+        Kind kind;
+        std::vector<unsigned> children;
+        Bytes_t bytes;
+        bool nullable;
+
+        bool operator==(const term &other) const
+        {
+            return kind == other.kind && children == other.children && bytes == other.bytes;
+        }
+    };
+
+    struct term_hash
+    {
+        std::size_t operator()(const term &t) const
+        {
+            std::size_t h = std::hash<Bytes_t>()(t.bytes) ^ static_cast<std::size_t>(t.kind);
+            for (auto child : t.children)
+            {
+                h = h * 31 + child;
+            }
+            return h;
+        }
+    };
+
+    unsigned intern(term &&t)
+    {
+        auto it = m_ids.find(t);
+        if (it != m_ids.end())
+        {
+            return it->second;
+        }
+        unsigned id = m_terms.size();
+        m_terms.push_back(t);
+        m_ids.emplace(std::move(t), id);
+        return id;
+    }
+
+    std::vector<term> m_terms;
+    std::unordered_map<term, unsigned, term_hash> m_ids;
+    std::unordered_map<unsigned long long, unsigned> m_derivatives;
+    unsigned m_nothing;
+    unsigned m_empty;
+};
+
+/**
+ * Builds each operand as a term, leaving all determinization to the derivatives.
+ */
+class term_builder
+{
+public:
+    typedef unsigned value_type;
+
+    term_builder(term_store &store, const compile_options &options) : m_store(store), m_options(options)
+    {
+    }
+
+    unsigned empty() const
+    {
+        return m_store.empty();
+    }
+
+    unsigned chars(const char_set &set) const
+    {
+        if (!m_options.utf8 || set.max() < 0x80)
+        {
+            term_store::Bytes_t bytes;
+            for (const auto &range : set.ranges())
+            {
+                for (unsigned c = range.first; c <= range.second; ++c)
+                {
+                    bytes.set(c);
+                }
+            }
+            return m_store.bytes(bytes);
+        }
+
+        // children come after their parents in the trie, so build the terms bottom-up
+        auto trie = utf8_trie(set);
+        std::vector<unsigned> terms(trie.size());
+        for (unsigned i = trie.size(); i-- > 0;)
+        {
+            if (trie[i].empty())
+            {
+                terms[i] = m_store.empty();
+                continue;
+            }
+            std::vector<unsigned> alternatives;
+            for (const auto &edge : trie[i])
+            {
+                term_store::Bytes_t bytes;
+                for (unsigned c = edge.first.first; c <= edge.first.second; ++c)
+                {
+                    bytes.set(c);
+                }
+                alternatives.push_back(m_store.concatenation(m_store.bytes(bytes), terms[edge.second]));
+            }
+            terms[i] = m_store.alternation(alternatives);
+        }
+        return terms[0];
+    }
+
+    unsigned kleene_star(unsigned x) const
+    {
+        return m_store.kleene_star(x);
+    }
+
+    unsigned concatenation(unsigned x, unsigned y) const
+    {
+        return m_store.concatenation(x, y);
+    }
+
+    unsigned alternation(unsigned x, unsigned y) const
+    {
+        return m_store.alternation({x, y});
+    }
+
+    unsigned repeat(unsigned x, unsigned min, unsigned max) const
+    {
+        // x{min,max} is min copies of x followed by (x(x...)?)?, all sharing one term for x
+        unsigned tail = m_store.empty();
+        if (max == DFA::unbounded)
+        {
+            tail = m_store.kleene_star(x);
+        }
+        else
+        {
+            for (unsigned i = min; i < max; ++i)
+            {
+                tail = m_store.alternation({m_store.empty(), m_store.concatenation(x, tail)});
+            }
+        }
+        for (unsigned i = 0; i < min; ++i)
+        {
+            tail = m_store.concatenation(x, tail);
+        }
+        return tail;
+    }
+
+    unsigned group(unsigned x, unsigned) const
+    {
+        return x;
+    }
+
+private:
+    term_store &m_store;
+    const compile_options &m_options;
+};
+
+/**
+ * A Thompson NFA whose epsilon moves are ordered by priority and may set a tag, i.e. record
+ * the current position. Group i is delimited by tags 2i - 2 and 2i - 1.
+ */
+struct tagged_nfa
+{
+    static const unsigned no_tag = ~0u;
+
+    struct epsilon
+    {
+        unsigned q;
+        unsigned tag;
+    };
+
+    struct range
+    {
+        unsigned char a;
+        unsigned char b;
+        unsigned q;
+    };
+
+    unsigned add_state()
+    {
+        epsilons.emplace_back();
+        ranges.emplace_back();
+        return epsilons.size() - 1;
+    }
+
+    unsigned size() const
+    {
+        return epsilons.size();
+    }
+
+    /**
+     * The epsilon moves of each state, highest priority first, and its byte moves.
+     */
+    std::vector<std::vector<epsilon>> epsilons;
+    std::vector<std::vector<range>> ranges;
+};
+
+const unsigned tagged_nfa::no_tag;
+
+/**
+ * Builds the tagged NFA of a pattern, one fragment per operand. Alternations prefer their
+ * left operand and repetitions one more iteration, so the first accepting path carries the
+ * submatches a backtracking matcher would report.
+ */
+class tagged_nfa_builder
+{
+public:
+    /**
+     * A fragment owns the states [first, last) of the NFA; its end has no moves yet.
+     */
+    struct value_type
+    {
+        unsigned first;
+        unsigned last;
+        unsigned start;
+        unsigned end;
+    };
+
+    tagged_nfa_builder(tagged_nfa &nfa, const compile_options &options) : m_nfa(nfa), m_options(options)
+    {
+    }
+
+    unsigned num_groups() const
+    {
+        return m_num_groups;
+    }
+
+    value_type empty()
+    {
+        unsigned q = m_nfa.add_state();
+        return {q, q + 1, q, q};
+    }
+
+    value_type chars(const char_set &set)
+    {
+        auto dfa = from_chars(set, m_options);
+        unsigned first = m_nfa.size();
+        for (unsigned q = 0; q <= dfa.num_states(); ++q)
+        {
+            m_nfa.add_state();
+        }
+        unsigned end = first + dfa.num_states();
+        for (const auto &rule : dfa.rules())
+        {
+            m_nfa.ranges[first + rule.p].push_back(
+                {static_cast<unsigned char>(rule.a), static_cast<unsigned char>(rule.b), first + rule.q});
+        }
+        for (unsigned q = 0; q < dfa.num_states(); ++q)
+        {
+            if (dfa.is_final(q))
+            {
+                m_nfa.epsilons[first + q].push_back({end, tagged_nfa::no_tag});
+            }
+        }
+        return {first, end + 1, first + dfa.start_state(), end};
+    }
+
+    value_type kleene_star(value_type &&x)
+    {
+        unsigned s = m_nfa.add_state();
+        unsigned e = m_nfa.add_state();
+        m_nfa.epsilons[s] = {{x.start, tagged_nfa::no_tag}, {e, tagged_nfa::no_tag}};
+        m_nfa.epsilons[x.end].push_back({s, tagged_nfa::no_tag});
+        return {x.first, e + 1, s, e};
+    }
+
+    value_type concatenation(value_type &&x, value_type &&y)
+    {
+        m_nfa.epsilons[x.end].push_back({y.start, tagged_nfa::no_tag});
+        return {x.first, y.last, x.start, y.end};
+    }
+
+    value_type alternation(value_type &&x, value_type &&y)
+    {
+        unsigned s = m_nfa.add_state();
+        unsigned e = m_nfa.add_state();
+        m_nfa.epsilons[s] = {{x.start, tagged_nfa::no_tag}, {y.start, tagged_nfa::no_tag}};
+        m_nfa.epsilons[x.end].push_back({e, tagged_nfa::no_tag});
+        m_nfa.epsilons[y.end].push_back({e, tagged_nfa::no_tag});
+        return {x.first, e + 1, s, e};
+    }
+
+    value_type repeat(value_type &&x, unsigned min, unsigned max)
+    {
+        if (max == 0)
+        {
+            auto e = empty();
+            return {x.first, e.last, e.start, e.end};
+        }
+        // x{min,max} is min copies of x followed by x* or by max - min nested optional copies
+        unsigned copies = max == DFA::unbounded ? min + 1 : max;
+        std::vector<value_type> xs{x};
+        while (xs.size() < copies)
+        {
+            xs.push_back(clone(x));
+        }
+        value_type result = empty();
+        for (unsigned i = 0; i < min; ++i)
+        {
+            result = concatenation(std::move(result), std::move(xs[i]));
+        }
+        if (max == DFA::unbounded)
+        {
+            result = concatenation(std::move(result), kleene_star(std::move(xs.back())));
+        }
+        else
+        {
+            value_type tail = empty();
+            for (unsigned i = max; i-- > min;)
+            {
+                tail = alternation(concatenation(std::move(xs[i]), std::move(tail)), empty());
+            }
+            result = concatenation(std::move(result), std::move(tail));
+        }
+        return {x.first, m_nfa.size(), result.start, result.end};
+    }
+
+    value_type group(value_type &&x, unsigned index)
+    {
+        m_num_groups = std::max(m_num_groups, index);
+        unsigned s = m_nfa.add_state();
+        unsigned e = m_nfa.add_state();
+        m_nfa.epsilons[s].push_back({x.start, 2 * index - 2});
+        m_nfa.epsilons[x.end].push_back({e, 2 * index - 1});
+        return {x.first, e + 1, s, e};
+    }
+
+private:
+    value_type clone(const value_type &x)
+    {
+        unsigned offset = m_nfa.size() - x.first;
+        for (unsigned q = x.first; q < x.last; ++q)
+        {
+            unsigned p = m_nfa.add_state();
+            for (auto e : m_nfa.epsilons[q])
+            {
+                e.q += offset;
+                m_nfa.epsilons[p].push_back(e);
+            }
+            for (auto r : m_nfa.ranges[q])
+            {
+                r.q += offset;
+                m_nfa.ranges[p].push_back(r);
+            }
+        }
+        return {x.first + offset, x.last + offset, x.start + offset, x.end + offset};
+    }
+
+    tagged_nfa &m_nfa;
+    const compile_options &m_options;
+    unsigned m_num_groups{0};
+};
+
+/**
+ * A thread of the tagged NFA: its state, the thread of the previous step it continues, and
+ * the tags set since.
+ */
+struct tagged_thread
+{
+    unsigned q;
+    unsigned from;
+    std::vector<unsigned> tags;
+};
+
+/**
+ * Follow the epsilon moves from the @seeds (state, previous thread), in priority order, to the
+ * states that read a byte or accept. A state is reached only by its first, highest priority path.
+ */
+std::vector<tagged_thread> tagged_closure(const tagged_nfa &nfa, unsigned accept,
+                                          const std::vector<std::pair<unsigned, unsigned>> &seeds)
+{
+    std::vector<tagged_thread> threads;
+    std::vector<bool> seen(nfa.size());
+    std::vector<tagged_thread> stack;
+    for (const auto &seed : seeds)
+    {
+        stack.push_back({seed.first, seed.second, {}});
+        while (!stack.empty())
+        {
+            auto thread = std::move(stack.back());
+            stack.pop_back();
+            if (seen[thread.q])
+            {
+                continue;
+            }
+            seen[thread.q] = true;
+            const auto &epsilons = nfa.epsilons[thread.q];
+            for (auto e = epsilons.rbegin(); e != epsilons.rend(); ++e)
+            {
+                stack.push_back(thread);
+                stack.back().q = e->q;
+                if (e->tag != tagged_nfa::no_tag)
+                {
+                    stack.back().tags.push_back(e->tag);
+                }
+            }
+            if (!nfa.ranges[thread.q].empty() || thread.q == accept)
+            {
+                std::sort(thread.tags.begin(), thread.tags.end());
+                thread.tags.erase(std::unique(thread.tags.begin(), thread.tags.end()), thread.tags.end());
+                threads.push_back(std::move(thread));
+            }
+        }
+    }
+    return threads;
+}
+
+/**
+ * Compile @regex by Brzozowski derivatives: each DFA state is a term, and its transition
+ * on a byte leads to the term's derivative by that byte.
+ */
+DFA from_derivatives(const char *regex, const compile_options &options)
+{
+    term_store store;
+    term_builder builder(store, options);
+    unsigned root = parse(regex, options, builder);
+
+    phase_scope phase(Phase::determinize);
+
+    // bytes no byte set tells apart have the same derivatives; the byte classes are
+    // the groups of bytes with the same membership in every set
+    auto sets = store.byte_sets();
+    std::map<std::vector<bool>, unsigned> class_of_signature;
+    std::vector<unsigned> class_of(256);
+    std::vector<unsigned char> representatives;
+    for (unsigned c = 1; c < 256; ++c)
+    {
+        std::vector<bool> signature(sets.size());
+        for (unsigned i = 0; i < sets.size(); ++i)
+        {
+            signature[i] = sets[i][c];
+        }
+        auto inserted = class_of_signature.emplace(signature, representatives.size());
+        if (inserted.second)
+        {
+            representatives.push_back(c);
+        }
+        class_of[c] = inserted.first->second;
+    }
+
+    const unsigned trap = ~0u;
+    std::unordered_map<unsigned, unsigned> state_of{{root, 0}};
+    std::vector<unsigned> terms{root};
+    uint_set F;
+    DFA::Rules_t R;
+    std::vector<unsigned> targets(representatives.size());
+    for (unsigned p = 0; p < terms.size(); ++p)
+    {
+        if (store.nullable(terms[p]))
+        {
+            F.add(p);
+        }
+        for (unsigned k = 0; k < representatives.size(); ++k)
+        {
+            unsigned d = store.derivative(terms[p], representatives[k]);
+            if (d == store.nothing())
+            {
+                targets[k] = trap;
+                continue;
+            }
+            auto inserted = state_of.emplace(d, terms.size());
+            if (inserted.second)
+            {
+                terms.push_back(d);
+                check_budget(terms.size());
+            }
+            targets[k] = inserted.first->second;
+        }
+        add_rules(R, p, class_of, targets, trap);
+    }
+
+    return DFA(0, F, R);
+}
+
+} // namespace
+
+DFA DFA::from_regex(const char *regex)
+{
+    return DFA::from_regex(regex, compile_options());
+}
+
+DFA DFA::from_regex(const char *regex, const compile_options &options)
+{
+    DFA dfa(0, {}, {});
+    if (options.max_errors > 0)
+    {
+        dfa = ApproximateDFA(regex, options).determinize();
+    }
+    else if (options.construction == Construction::derivatives)
+    {
+        dfa = from_derivatives(regex, options);
+    }
+    else
+    {
+        // the state sets of intermediate automata come from one arena, freed all at once;
+        // the result is moved out of it after the scope ends
+        uint_set_arena arena;
+        dfa = DFA::_parse(regex, options, arena);
+        dfa.m_F = uint_set(dfa.m_F);
+    }
+    if (auto stats = current_stats())
+    {
+        stats->dfa_states = dfa.num_states();
+        stats->dfa_rules = dfa.rules().size();
+    }
+    if (options.minimize)
+    {
+        dfa = dfa.minimize();
+        if (auto stats = current_stats())
+        {
+            stats->minimized_states = dfa.num_states();
+        }
+    }
+    if (options.stride == 2)
+    {
+        phase_scope phase(Phase::table);
+        dfa.build_pair_table(options.max_stride_bytes);
+    }
+    return dfa;
+}
+
+DFA DFA::_parse(const char *regex, const compile_options &options, uint_set_arena &arena)
+{
+    uint_set::arena_scope scope(arena);
+    key_builder keys;
+    parse(regex, options, keys);
+    dfa_builder builder(options, keys);
+    DFA dfa(0, {}, {});
+    {
+        table_deferral deferral;
+        dfa = parse(regex, options, builder).dfa;
+    }
+    dfa.build_table();
+    return dfa;
+}
+
+unsigned DFA::num_states() const
+{
+    return m_num_states;
+}
+
+unsigned DFA::num_classes() const
+{
+    return m_num_classes;
+}
+
+const DFA::Rules_t &DFA::rules() const
+{
+    return m_R;
+}
+
+void DFA::reset()
+{
+    m_state = m_s;
+    m_trapped = false;
+}
+
+void DFA::advance(char a)
+{
+    auto q = transition(m_state * m_num_classes + m_classes[static_cast<unsigned char>(a)]);
+    if (q == m_num_states)
+    {
+        m_trapped = true;
+        return;
+    }
+    m_state = q;
+}
+
+bool DFA::operator()(const char *tape)
+{
+    reset();
+    while (*tape != '\0')
+    {
+        advance(*tape);
+        if (m_trapped)
+        {
+            return false;
+        }
+        ++tape;
+    }
+    return m_F.has(m_state);
+}
+
+bool DFA::match(const char *string)
+{
+    return this->operator()(string);
+}
+
+bool DFA::match(const char *data, std::size_t size) const
+{
+    if (!m_table8.single.empty())
+    {
+        return match(m_table8, data, size);
+    }
+    if (!m_table16.single.empty())
+    {
+        return match(m_table16, data, size);
+    }
+    return match(m_table32, data, size);
+}
+
+template <class State>
+bool DFA::match(const table_t<State> &table, const char *data, std::size_t size) const
+{
+    const unsigned width = m_num_classes;
+    const State *entries = table.single.data();
+    const unsigned char *classes = m_classes.data();
+    const unsigned char *flags = m_flags.data();
+    const unsigned char stop = dead_flag | absorbing_flag;
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    unsigned state = m_s;
+    if (flags[state] & stop)
+    {
+        return settle(state, tape, size);
+    }
+    std::size_t i = 0;
+    if (!table.pairs.empty())
+    {
+        // the classes of a pair do not depend on the state, so only one load per pair is on the chain;
+        // dead and absorbing states are closed under transitions, so checking every other state is enough
+        const State *pairs = table.pairs.data();
+        for (; i + 1 < size; i += 2)
+        {
+            state = pairs[(state * width + classes[tape[i]]) * width + classes[tape[i + 1]]];
+            if (flags[state] & stop)
+            {
+                return settle(state, tape + i + 2, size - i - 2);
+            }
+        }
+    }
+    for (; i < size; ++i)
+    {
+        state = entries[state * width + classes[tape[i]]];
+        if (flags[state] & stop)
+        {
+            return settle(state, tape + i + 1, size - i - 1);
+        }
+    }
+    return flags[state] & final_flag;
+}
+
+bool DFA::settle(unsigned state, const unsigned char *rest, std::size_t size) const
+{
+    if (m_flags[state] & dead_flag)
+    {
+        return false;
+    }
+    // absorbing: only a null byte, which is never read, could still reject
+    return std::memchr(rest, '\0', size) == nullptr;
+}
+
+bool DFA::is_match_prefix(const char *data, std::size_t size) const
+{
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    unsigned state = m_s;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        if (m_flags[state] & (dead_flag | absorbing_flag))
+        {
+            return settle(state, tape + i, size - i);
+        }
+        state = transition(state * m_num_classes + m_classes[tape[i]]);
+    }
+    return !(m_flags[state] & dead_flag);
+}
+
+std::ptrdiff_t DFA::earliest_match(const char *data, std::size_t size) const
+{
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    unsigned state = m_s;
+    for (std::size_t i = 0;; ++i)
+    {
+        if (m_flags[state] & final_flag)
+        {
+            return i;
+        }
+        if (i == size || (m_flags[state] & dead_flag))
+        {
+            return -1;
+        }
+        state = transition(state * m_num_classes + m_classes[tape[i]]);
+    }
+}
+
+void DFA::build_pair_table(std::size_t max_bytes)
+{
+    if (!m_table8.single.empty())
+    {
+        build_pair_table(m_table8, max_bytes);
+    }
+    else if (!m_table16.single.empty())
+    {
+        build_pair_table(m_table16, max_bytes);
+    }
+    else
+    {
+        build_pair_table(m_table32, max_bytes);
+    }
+}
+
+template <class State>
+void DFA::build_pair_table(table_t<State> &table, std::size_t max_bytes)
+{
+    const std::size_t width = m_num_classes;
+    if (table.single.size() * width * sizeof(State) > max_bytes)
+    {
+        return;
+    }
+    table.pairs.resize(table.single.size() * width);
+    for (std::size_t i = 0; i < table.single.size(); ++i)
+    {
+        const State *next = &table.single[table.single[i] * width];
+        std::copy(next, next + width, &table.pairs[i * width]);
+    }
+}
+
+bool DFA::profile(const char *data, std::size_t size, std::vector<unsigned long long> &visits) const
+{
+    if (visits.size() < m_num_states)
+    {
+        visits.resize(m_num_states);
+    }
+    const unsigned trap = m_num_states;
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    unsigned state = m_s;
+    ++visits[state];
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        state = transition(state * m_num_classes + m_classes[tape[i]]);
+        if (state == trap)
+        {
+            return false;
+        }
+        ++visits[state];
+    }
+    return m_F.has(state);
+}
+
+DFA DFA::reorder() const
+{
+    return reorder({});
+}
+
+DFA DFA::reorder(const std::vector<unsigned long long> &visits) const
+{
+    std::vector<unsigned> order{m_s};
+    std::vector<bool> seen(m_num_states + 1);
+    seen[m_s] = seen[m_num_states] = true;
+    for (unsigned i = 0; i < order.size(); ++i)
+    {
+        for (unsigned k = 0; k < m_num_classes; ++k)
+        {
+            unsigned q = transition(order[i] * m_num_classes + k);
+            if (!seen[q])
+            {
+                seen[q] = true;
+                order.push_back(q);
+            }
+        }
+    }
+    auto count = [&](unsigned q) { return q < visits.size() ? visits[q] : 0; };
+    std::stable_sort(order.begin(), order.end(), [&](unsigned x, unsigned y) { return count(x) > count(y); });
+    return renumber(order);
+}
+
+DFA DFA::renumber(const std::vector<unsigned> &order) const
+{
+    const unsigned dropped = ~0u;
+    std::vector<unsigned> id(m_num_states, dropped);
+    for (unsigned i = 0; i < order.size(); ++i)
+    {
+        id[order[i]] = i;
+    }
+    uint_set F;
+    for (const auto &f : m_F)
+    {
+        if (id[f] != dropped)
+        {
+            F.add(id[f]);
+        }
+    }
+    Rules_t R;
+    for (const auto &r : m_R)
+    {
+        if (id[r.p] != dropped && id[r.q] != dropped)
+        {
+            R.emplace_back(id[r.p], r.a, r.b, id[r.q]);
+        }
+    }
+    return DFA(id[m_s], F, R);
+}
+
+std::size_t DFA::table_bytes() const
+{
+    return m_table8.single.size() + m_table8.pairs.size() + (m_table16.single.size() + m_table16.pairs.size()) * 2 +
+           (m_table32.single.size() + m_table32.pairs.size()) * 4 + m_classes.size();
+}
+
+unsigned DFA::state_bytes() const
+{
+    return !m_table8.single.empty() ? 1 : !m_table16.single.empty() ? 2 : 4;
+}
+
+unsigned DFA::stride() const
+{
+    return m_table8.pairs.empty() && m_table16.pairs.empty() && m_table32.pairs.empty() ? 1 : 2;
+}
+
+unsigned DFA::start_state() const
+{
+    return m_s;
+}
+
+unsigned DFA::byte_class(unsigned char byte) const
+{
+    return m_classes[byte];
+}
+
+unsigned DFA::next_state(unsigned q, unsigned char byte) const
+{
+    return transition(q * m_num_classes + m_classes[byte]);
+}
+
+bool DFA::is_final(unsigned q) const
+{
+    return q != m_num_states && m_F.has(q);
+}
+
+bool DFA::is_dead(unsigned q) const
+{
+    return m_flags[q] & dead_flag;
+}
+
+bool DFA::is_absorbing(unsigned q) const
+{
+    return m_flags[q] & absorbing_flag;
+}
+
+DFA DFA::kleene_star() const &
+{
+    auto R = m_R;
+    return kleene_star(R);
+}
+
+DFA DFA::kleene_star() &&
+{
+    return kleene_star(m_R);
+}
+
+DFA DFA::kleene_star(Rules_t &R) const
+{
+    unsigned s = R.size() * 2 + 1;
+    auto F = m_F | uint_set({s});
+    R.reserve(R.size() + m_num_states + 1);
+    for (const auto &f : F)
+    {
+        R.push_back({f, '\0', m_s});
+    }
+
+    return DFA::from_NFA(s, F, R);
+}
+
+DFA DFA::concatenation(const DFA &other) const &
+{
+    auto R = m_R;
+    return concatenation(R, other);
+}
+
+DFA DFA::concatenation(const DFA &other) &&
+{
+    return concatenation(m_R, other);
+}
+
+DFA DFA::concatenation(Rules_t &R, const DFA &other) const
+{
+    unsigned s_other;
+    uint_set F_other;
+    Rules_t R_other;
+    other.pclone(s_other, F_other, R_other, m_num_states / 8 + 1);
+
+    auto s = m_s;
+    auto F = std::move(F_other);
+    R.reserve(R.size() + R_other.size() + m_num_states);
+    R.insert(R.end(), R_other.begin(), R_other.end());
+    for (const auto &f : m_F)
+    {
+        R.push_back({f, '\0', s_other});
+    }
+
+    return DFA::from_NFA(s, F, R);
+}
+
+DFA DFA::alternation(const DFA &other) const &
+{
+    auto R = m_R;
+    return alternation(R, other);
+}
+
+DFA DFA::alternation(const DFA &other) &&
+{
+    return alternation(m_R, other);
+}
+
+DFA DFA::alternation(Rules_t &R, const DFA &other) const
+{
+    unsigned s_other;
+    uint_set F_other;
+    Rules_t R_other;
+    other.pclone(s_other, F_other, R_other, m_num_states / 8 + 1);
+
+    unsigned s = other.m_num_states + (m_num_states / 8 + 1) * 8 + 1;
+    auto F = m_F | F_other;
+    R.reserve(R.size() + R_other.size() + 2);
+    R.insert(R.end(), R_other.begin(), R_other.end());
+    R.emplace_back(s, '\0', m_s);
+    R.emplace_back(s, '\0', s_other);
+
+    return DFA::from_NFA(s, F, R);
+}
+
+DFA DFA::intersection(const DFA &other) const
+{
+    return product(other, Product::intersection);
+}
+
+DFA DFA::difference(const DFA &other) const
+{
+    return product(other, Product::difference);
+}
+
+DFA DFA::complement() const
+{
+    DFA all(0, {0}, {{0, '\x01', '\xFF', 0}});
+    return all.difference(*this);
+}
+
+DFA DFA::product(const DFA &other, Product op) const
+{
+    phase_scope phase(Phase::determinize);
+
+    // the byte classes of the product are the pairs of classes that occur together
+    std::map<std::pair<unsigned, unsigned>, unsigned> pair_class;
+    std::vector<unsigned> class_of(256);
+    std::vector<unsigned char> representatives;
+    for (unsigned c = 1; c < 256; ++c)
+    {
+        auto inserted = pair_class.emplace(std::make_pair(m_classes[c], other.m_classes[c]), representatives.size());
+        if (inserted.second)
+        {
+            representatives.push_back(c);
+        }
+        class_of[c] = inserted.first->second;
+    }
+
+    // states are the reachable pairs of states, including the trap rows of either table
+    const unsigned trap = ~0u;
+    typedef std::pair<unsigned, unsigned> Pair_t;
+    std::map<Pair_t, unsigned> state_of{{{m_s, other.m_s}, 0}};
+    std::vector<Pair_t> states{{m_s, other.m_s}};
+    uint_set F;
+    Rules_t R;
+    std::vector<unsigned> targets(representatives.size());
+    for (unsigned p = 0; p < states.size(); ++p)
+    {
+        auto x = states[p];
+        bool final_x = x.first != m_num_states && m_F.has(x.first);
+        bool final_y = x.second != other.m_num_states && other.m_F.has(x.second);
+        if (final_x && (op == Product::intersection ? final_y : !final_y))
+        {
+            F.add(p);
+        }
+        for (unsigned k = 0; k < representatives.size(); ++k)
+        {
+            unsigned c = representatives[k];
+            Pair_t y(next_state(x.first, c), other.next_state(x.second, c));
+            // nothing is accepted past the trap of the left side, or for an intersection of either side
+            if (y.first == m_num_states || (op == Product::intersection && y.second == other.m_num_states))
+            {
+                targets[k] = trap;
+                continue;
+            }
+            auto inserted = state_of.emplace(y, states.size());
+            if (inserted.second)
+            {
+                states.push_back(y);
+                check_budget(states.size());
+            }
+            targets[k] = inserted.first->second;
+        }
+        add_rules(R, p, class_of, targets, trap);
+    }
+
+    return DFA(0, F, R).minimize();
+}
+
+DFA DFA::minimize() const
+{
+    phase_scope phase(Phase::minimize);
+
+    // the reachable states; the trap row takes part as a non-final state
+    const unsigned trap = m_num_states;
+    std::vector<unsigned> reachable{m_s, trap};
+    std::vector<bool> seen(m_num_states + 1);
+    seen[m_s] = seen[trap] = true;
+    for (unsigned i = 0; i < reachable.size(); ++i)
+    {
+        for (unsigned k = 0; k < m_num_classes; ++k)
+        {
+            unsigned q = transition(reachable[i] * m_num_classes + k);
+            if (!seen[q])
+            {
+                seen[q] = true;
+                reachable.push_back(q);
+            }
+        }
+    }
+
+    // Moore's algorithm: split by finality, then by the blocks the byte classes lead to, until stable
+    std::vector<unsigned> block(m_num_states + 1);
+    unsigned num_blocks = 0;
+    for (auto q : reachable)
+    {
+        block[q] = q != trap && m_F.has(q);
+    }
+    for (;;)
+    {
+        std::map<std::vector<unsigned>, unsigned> block_of;
+        std::vector<unsigned> next(m_num_states + 1);
+        for (auto q : reachable)
+        {
+            std::vector<unsigned> signature{block[q]};
+            for (unsigned k = 0; k < m_num_classes; ++k)
+            {
+                signature.push_back(block[transition(q * m_num_classes + k)]);
+            }
+            next[q] = block_of.emplace(signature, block_of.size()).first->second;
+        }
+        block.swap(next);
+        if (block_of.size() == num_blocks)
+        {
+            break;
+        }
+        num_blocks = block_of.size();
+    }
+
+    // the trap's block holds the states that cannot reach a final state; the others are renumbered
+    const unsigned dead = ~0u;
+    std::vector<unsigned> state_of(num_blocks, dead);
+    std::vector<unsigned> representative;
+    for (auto q : reachable)
+    {
+        if (block[q] != block[trap] && state_of[block[q]] == dead)
+        {
+            state_of[block[q]] = representative.size();
+            representative.push_back(q);
+        }
+    }
+
+    uint_set F;
+    Rules_t R;
+    std::vector<unsigned> targets(m_num_classes);
+    for (unsigned p = 0; p < representative.size(); ++p)
+    {
+        unsigned q = representative[p];
+        if (m_F.has(q))
+        {
+            F.add(p);
+        }
+        for (unsigned k = 0; k < m_num_classes; ++k)
+        {
+            targets[k] = state_of[block[transition(q * m_num_classes + k)]];
+        }
+        add_rules(R, p, m_classes, targets, dead);
+    }
+    if (representative.empty())
+    {
+        // nothing is accepted
+        return DFA(0, {}, {});
+    }
+    return DFA(state_of[block[m_s]], F, R);
+}
+
+const unsigned DFA::unbounded;
+
+DFA DFA::repeat(unsigned min, unsigned max) const
+{
+    if (max == 0)
+    {
+        return DFA(0, {0}, {{0, '\0', 0}});
+    }
+
+    // copy i (from 0) sits i * stride states up; the last one loops if unbounded
+    unsigned copies = max == unbounded ? std::max(min, 1u) : max;
+    unsigned stride = m_num_states / 8 + 1;
+    std::vector<unsigned> starts(copies);
+    std::vector<uint_set> finals(copies);
+    Rules_t R;
+    R.reserve(copies * (m_R.size() + m_num_states) + 1);
+    for (unsigned i = 0; i < copies; ++i)
+    {
+        Rules_t R_copy;
+        pclone(starts[i], finals[i], R_copy, i * stride);
+        R.insert(R.end(), R_copy.begin(), R_copy.end());
+    }
+
+    uint_set F;
+    for (unsigned i = 0; i < copies; ++i)
+    {
+        unsigned next = i + 1 < copies ? starts[i + 1] : starts[i];
+        if (i + 1 < copies || max == unbounded)
+        {
+            for (const auto &f : finals[i])
+            {
+                R.push_back({f, '\0', next});
+            }
+        }
+        if (i + 1 >= min)
+        {
+            F |= finals[i];
+        }
+    }
+
+    unsigned s = starts[0];
+    if (min == 0)
+    {
+        s = copies * stride * 8;
+        F.add(s);
+        R.push_back({s, '\0', starts[0]});
+    }
+
+    return DFA::from_NFA(s, F, R);
+}
+
+const unsigned char CompressedDFA::free;
+
+CompressedDFA::CompressedDFA(const DFA &dfa)
+    : m_start(dfa.start_state()), m_trap(dfa.num_states()), m_classes(256), m_final(dfa.num_states())
+{
+    const unsigned num_states = dfa.num_states();
+    const unsigned width = dfa.num_classes();
+    std::vector<unsigned char> representatives(width);
+    for (unsigned c = 0; c < 256; ++c)
+    {
+        m_classes[c] = dfa.byte_class(c);
+        representatives[m_classes[c]] = c;
+    }
+
+    // the transitions of each state that differ from its most common target
+    std::vector<std::vector<std::pair<unsigned, unsigned>>> entries(num_states);
+    std::vector<unsigned> fallbacks(num_states);
+    std::vector<unsigned> targets(width);
+    std::map<unsigned, unsigned> counts;
+    for (unsigned q = 0; q < num_states; ++q)
+    {
+        m_final[q] = dfa.is_final(q);
+        counts.clear();
+        for (unsigned k = 0; k < width; ++k)
+        {
+            targets[k] = dfa.next_state(q, representatives[k]);
+            ++counts[targets[k]];
+        }
+        // ties go to the trap, so that strings of the language only take stored transitions,
+        // and otherwise to the lowest target
+        unsigned fallback = m_trap;
+        unsigned most = counts.count(m_trap) ? counts[m_trap] : 0;
+        for (const auto &count : counts)
+        {
+            if (count.second > most)
+            {
+                fallback = count.first;
+                most = count.second;
+            }
+        }
+        fallbacks[q] = fallback;
+        for (unsigned k = 0; k < width; ++k)
+        {
+            if (targets[k] != fallback)
+            {
+                entries[q].emplace_back(k, targets[k]);
+            }
+        }
+    }
+
+    // first fit, longest rows first; every row reads up to width slots past its base, and the
+    // rows of states sharing a check byte must not overlap
+    std::vector<unsigned> order(num_states);
+    for (unsigned q = 0; q < order.size(); ++q)
+    {
+        order[q] = q;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](unsigned x, unsigned y) {
+        return entries[x].size() > entries[y].size();
+    });
+    const unsigned unowned = ~0u;
+    std::vector<unsigned> bases(num_states);
+    std::vector<unsigned> owners(width, unowned);
+    std::vector<unsigned> slots(width);
+    std::vector<std::set<unsigned>> bases_by_check(free);
+    unsigned first_free = 0;
+    for (auto q : order)
+    {
+        const auto &row = entries[q];
+        auto &same_check = bases_by_check[q % free];
+        while (first_free < owners.size() && owners[first_free] != unowned)
+        {
+            ++first_free;
+        }
+        unsigned base = row.empty() || first_free < row[0].first ? 0 : first_free - row[0].first;
+        for (;;)
+        {
+            auto overlap = same_check.lower_bound(base < width ? 0 : base - width + 1);
+            if (overlap != same_check.end() && *overlap < base + width)
+            {
+                base = *overlap + width;
+                continue;
+            }
+            if (owners.size() < base + width)
+            {
+                owners.resize(base + width, unowned);
+                slots.resize(base + width);
+            }
+            if (std::all_of(row.begin(), row.end(), [&](const std::pair<unsigned, unsigned> &entry) {
+                    return owners[base + entry.first] == unowned;
+                }))
+            {
+                break;
+            }
+            ++base;
+        }
+        bases[q] = base;
+        same_check.insert(base);
+        for (const auto &entry : row)
+        {
+            owners[base + entry.first] = q;
+            slots[base + entry.first] = entry.second;
+        }
+    }
+
+    // the narrowest state ids that hold the trap
+    if (m_trap <= 0xFF)
+    {
+        fill(m_table8, bases, fallbacks, owners, slots);
+    }
+    else if (m_trap <= 0xFFFF)
+    {
+        fill(m_table16, bases, fallbacks, owners, slots);
+    }
+    else
+    {
+        fill(m_table32, bases, fallbacks, owners, slots);
+    }
+}
+
+template <class State>
+void CompressedDFA::fill(table_t<State> &table, const std::vector<unsigned> &bases, const std::vector<unsigned> &fallbacks,
+                         const std::vector<unsigned> &owners, const std::vector<unsigned> &slots)
+{
+    table.rows.resize(bases.size());
+    for (unsigned q = 0; q < bases.size(); ++q)
+    {
+        table.rows[q] = {bases[q], static_cast<State>(fallbacks[q]), static_cast<unsigned char>(q % free)};
+    }
+    table.slots.resize(owners.size());
+    for (std::size_t i = 0; i < owners.size(); ++i)
+    {
+        bool owned = owners[i] != ~0u;
+        table.slots[i] = {static_cast<State>(owned ? slots[i] : 0), static_cast<unsigned char>(owned ? owners[i] % free : free)};
+    }
+}
+
+bool CompressedDFA::match(const char *data, std::size_t size) const
+{
+    if (!m_table8.rows.empty())
+    {
+        return match(m_table8, data, size);
+    }
+    if (!m_table16.rows.empty())
+    {
+        return match(m_table16, data, size);
+    }
+    return match(m_table32, data, size);
+}
+
+template <class State>
+bool CompressedDFA::match(const table_t<State> &table, const char *data, std::size_t size) const
+{
+    const unsigned trap = m_trap;
+    const row_t<State> *rows = table.rows.data();
+    const slot_t<State> *slots = table.slots.data();
+    const unsigned char *classes = m_classes.data();
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    unsigned state = m_start;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        const auto &r = rows[state];
+        const auto &s = slots[r.base + classes[tape[i]]];
+        state = s.check == r.check ? s.next : r.fallback;
+        if (state == trap)
+        {
+            return false;
+        }
+    }
+    return m_final[state];
+}
+
+unsigned CompressedDFA::num_states() const
+{
+    return m_final.size();
+}
+
+std::size_t CompressedDFA::table_bytes() const
+{
+    return m_classes.size() + table_bytes(m_table8) + table_bytes(m_table16) + table_bytes(m_table32) + m_final.size() / 8;
+}
+
+template <class State>
+std::size_t CompressedDFA::table_bytes(const table_t<State> &table) const
+{
+    return table.rows.size() * sizeof(row_t<State>) + table.slots.size() * sizeof(slot_t<State>);
+}
+
+const unsigned ShuffleDFA::bank_states;
+const unsigned ShuffleDFA::pair_bytes;
+const unsigned ShuffleDFA::unused;
+
+ShuffleDFA::ShuffleDFA(const std::vector<DFA> &dfas) : m_num_banks(0), m_size(dfas.size())
+{
+    std::vector<DFA> minimized;
+    std::vector<const DFA *> small(dfas.size());
+    minimized.reserve(dfas.size());
+    for (std::size_t i = 0; i < dfas.size(); ++i)
+    {
+        small[i] = &dfas[i];
+        if (dfas[i].num_states() >= bank_states)
+        {
+            minimized.push_back(dfas[i].minimize());
+            small[i] = &minimized.back();
+            if (small[i]->num_states() >= bank_states)
+            {
+                throw std::invalid_argument("ShuffleDFA takes automata of at most 15 states");
+            }
+        }
+    }
+
+    // first fit, biggest automata first; a bank has room for bank_states - 1 states besides its trap
+    std::vector<unsigned> order(dfas.size());
+    for (unsigned i = 0; i < order.size(); ++i)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](unsigned x, unsigned y) {
+        return small[x]->num_states() > small[y]->num_states();
+    });
+    std::vector<unsigned> used;
+    std::vector<std::vector<unsigned>> members;
+    for (auto i : order)
+    {
+        unsigned bank = 0;
+        while (bank < used.size() && used[bank] + small[i]->num_states() >= bank_states)
+        {
+            ++bank;
+        }
+        if (bank == used.size())
+        {
+            used.push_back(0);
+            members.emplace_back();
+        }
+        used[bank] += small[i]->num_states();
+        members[bank].push_back(i);
+    }
+    m_num_banks = used.size();
+
+    // banks are laid out by pairs; an odd one out is paired with a bank of traps only
+    const std::size_t pairs = (m_num_banks + 1) / 2;
+    m_tables.assign(pairs * 256 * pair_bytes, 0);
+    m_starts.assign(pairs * pair_bytes, 0);
+    m_owners.assign(pairs * pair_bytes, unused);
+    m_finals.assign(pairs * pair_bytes, 0);
+    for (unsigned bank = 0; bank < m_num_banks; ++bank)
+    {
+        const std::size_t offset = bank / 2 * 256 * pair_bytes + bank % 2 * bank_states;
+        const std::size_t lanes = bank / 2 * pair_bytes + bank % 2 * bank_states;
+        unsigned base = 1;
+        for (unsigned lane = 0; lane < members[bank].size(); ++lane)
+        {
+            const unsigned i = members[bank][lane];
+            const DFA &dfa = *small[i];
+            const unsigned trap = dfa.num_states();
+            m_starts[lanes + lane] = base + dfa.start_state();
+            m_owners[lanes + lane] = i;
+            for (unsigned q = 0; q < trap; ++q)
+            {
+                m_finals[lanes + base + q] = dfa.is_final(q) ? 0xFF : 0;
+                for (unsigned c = 0; c < 256; ++c)
+                {
+                    unsigned next = dfa.next_state(q, c);
+                    m_tables[offset + c * pair_bytes + base + q] = next == trap ? 0 : base + next;
+                }
+            }
+            base += trap;
+        }
+    }
+}
+
+std::vector<unsigned> ShuffleDFA::match(const char *data, std::size_t size) const
+{
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    std::vector<unsigned> matched;
+#if defined(__SSSE3__)
+    // checking whether every automaton is trapped takes a few vector operations, so only every block bytes
+    const std::size_t block = 64;
+#endif
+    for (std::size_t pair = 0; pair < m_starts.size() / pair_bytes; ++pair)
+    {
+        const unsigned char *table = m_tables.data() + pair * 256 * pair_bytes;
+        const unsigned char *starts = m_starts.data() + pair * pair_bytes;
+        const unsigned char *finals = m_finals.data() + pair * pair_bytes;
+        std::uint32_t accepted = 0;
+#if defined(__AVX2__)
+        // vpshufb shuffles each 128-bit half on its own, one bank each
+        __m256i state = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(starts));
+        for (std::size_t i = 0; i < size;)
+        {
+            for (std::size_t end = std::min(size, i + block); i < end; ++i)
+            {
+                state = _mm256_shuffle_epi8(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(table + tape[i] * pair_bytes)), state);
+            }
+            if (_mm256_testz_si256(state, state))
+            {
+                break;
+            }
+        }
+        state = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(finals)), state);
+        accepted = _mm256_movemask_epi8(state);
+#elif defined(__SSSE3__)
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(starts));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(starts + bank_states));
+        for (std::size_t i = 0; i < size;)
+        {
+            for (std::size_t end = std::min(size, i + block); i < end; ++i)
+            {
+                const unsigned char *row = table + tape[i] * pair_bytes;
+                low = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row)), low);
+                high = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row + bank_states)), high);
+            }
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(low, high), _mm_setzero_si128())) == 0xFFFF)
+            {
+                break;
+            }
+        }
+        low = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(finals)), low);
+        high = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(finals + bank_states)), high);
+        accepted = static_cast<std::uint32_t>(_mm_movemask_epi8(low)) | static_cast<std::uint32_t>(_mm_movemask_epi8(high)) << 16;
+#else
+        for (unsigned lane = 0; lane < pair_bytes; ++lane)
+        {
+            if (m_owners[pair * pair_bytes + lane] == unused)
+            {
+                continue;
+            }
+            const unsigned half = lane / bank_states * bank_states;
+            unsigned state = starts[lane];
+            for (std::size_t i = 0; i < size && state != 0; ++i)
+            {
+                state = table[tape[i] * pair_bytes + half + state];
+            }
+            if (finals[half + state])
+            {
+                accepted |= std::uint32_t(1) << lane;
+            }
+        }
+#endif
+        for (unsigned lane = 0; lane < pair_bytes; ++lane)
+        {
+            if (accepted >> lane & 1)
+            {
+                matched.push_back(m_owners[pair * pair_bytes + lane]);
+            }
+        }
+    }
+    std::sort(matched.begin(), matched.end());
+    return matched;
+}
+
+std::size_t ShuffleDFA::size() const
+{
+    return m_size;
+}
+
+unsigned ShuffleDFA::num_banks() const
+{
+    return m_num_banks;
+}
+
+TaggedDFA::TaggedDFA(const char *pattern, const compile_options &options)
+{
+    auto now = clock_type::now();
+    compile_context context{&options, now, uint_set::usage().current, nullptr, Phase::parse, now};
+    context_scope scope(&context);
+
+    tagged_nfa nfa;
+    tagged_nfa_builder builder(nfa, options);
+    const auto fragment = parse(pattern, options, builder);
+    const unsigned accept = fragment.end;
+    m_num_groups = builder.num_groups();
+
+    // byte classes: the intervals between the boundaries of the byte moves
+    bool cut[257] = {true, true};
+    for (const auto &ranges : nfa.ranges)
+    {
+        for (const auto &r : ranges)
+        {
+            cut[r.a] = true;
+            cut[r.b + 1] = true;
+        }
+    }
+    std::vector<unsigned char> representatives;
+    m_classes.resize(256);
+    for (unsigned c = 0; c < 256; ++c)
+    {
+        if (cut[c])
+        {
+            representatives.push_back(c);
+        }
+        m_classes[c] = representatives.size() - 1;
+    }
+    m_num_classes = representatives.size();
+
+    // subset construction over ordered thread lists; a state is the list of its NFA states
+    typedef std::pair<std::vector<unsigned>, std::vector<std::pair<unsigned, unsigned>>> Action_t;
+    std::map<std::vector<unsigned>, unsigned> state_of;
+    std::map<Action_t, unsigned> action_of;
+    std::vector<std::vector<tagged_thread>> states;
+    auto add_state = [&](std::vector<tagged_thread> &&threads) {
+        std::vector<unsigned> key;
+        for (const auto &thread : threads)
+        {
+            key.push_back(thread.q);
+        }
+        auto inserted = state_of.emplace(key, states.size());
+        if (inserted.second)
+        {
+            check_budget(states.size() + 1);
+            m_max_threads = std::max<unsigned>(m_max_threads, threads.size());
+            states.push_back(std::move(threads));
+        }
+        return inserted.first->second;
+    };
+    auto tags_of = [](const std::vector<tagged_thread> &threads) {
+        std::vector<std::pair<unsigned, unsigned>> tags;
+        for (unsigned j = 0; j < threads.size(); ++j)
+        {
+            for (auto tag : threads[j].tags)
+            {
+                tags.emplace_back(j, tag);
+            }
+        }
+        return tags;
+    };
+
+    auto start = tagged_closure(nfa, accept, {{fragment.start, 0}});
+    m_start_tags = tags_of(start);
+    if (!start.empty())
+    {
+        add_state(std::move(start));
+    }
+    const unsigned trap = ~0u;
+    std::vector<std::pair<unsigned, unsigned>> seeds;
+    for (unsigned p = 0; p < states.size(); ++p)
+    {
+        for (auto c : representatives)
+        {
+            seeds.clear();
+            for (unsigned i = 0; i < states[p].size(); ++i)
+            {
+                for (const auto &r : nfa.ranges[states[p][i].q])
+                {
+                    if (r.a <= c && c <= r.b)
+                    {
+                        seeds.emplace_back(r.q, i);
+                        break;
+                    }
+                }
+            }
+            auto threads = tagged_closure(nfa, accept, seeds);
+            if (threads.empty())
+            {
+                m_next.push_back(trap);
+                m_action_of.push_back(0);
+                continue;
+            }
+            Action_t action;
+            for (const auto &thread : threads)
+            {
+                action.first.push_back(thread.from);
+            }
+            action.second = tags_of(threads);
+            auto inserted = action_of.emplace(action, m_actions.size());
+            if (inserted.second)
+            {
+                bool identity = true;
+                for (unsigned j = 0; identity && j < action.first.size(); ++j)
+                {
+                    identity = action.first[j] == j;
+                }
+                m_actions.push_back({std::move(action.first), std::move(action.second), identity});
+            }
+            m_action_of.push_back(inserted.first->second);
+            m_next.push_back(add_state(std::move(threads)));
+        }
+    }
+
+    m_num_states = states.size();
+    for (auto &q : m_next)
+    {
+        q = q == trap ? m_num_states : q;
+    }
+    for (const auto &threads : states)
+    {
+        unsigned accepting = no_thread;
+        for (unsigned j = 0; j < threads.size() && accepting == no_thread; ++j)
+        {
+            if (threads[j].q == accept)
+            {
+                accepting = j;
+            }
+        }
+        m_accept.push_back(accepting);
+    }
+}
+
+bool TaggedDFA::match(const char *data, std::size_t size, Groups_t &groups) const
+{
+    if (m_num_states == 0)
+    {
+        return false;
+    }
+    const unsigned num_tags = 2 * m_num_groups;
+    std::vector<std::ptrdiff_t> registers(m_max_threads * num_tags, -1);
+    std::vector<std::ptrdiff_t> next(registers.size());
+    for (const auto &tag : m_start_tags)
+    {
+        registers[tag.first * num_tags + tag.second] = 0;
+    }
+
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    unsigned state = 0;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        std::size_t k = state * m_num_classes + m_classes[tape[i]];
+        state = m_next[k];
+        if (state == m_num_states)
+        {
+            return false;
+        }
+        if (num_tags == 0)
+        {
+            continue;
+        }
+        // each thread continues a thread of the previous step, then sets its tags
+        const auto &a = m_actions[m_action_of[k]];
+        if (!a.identity)
+        {
+            for (unsigned j = 0; j < a.from.size(); ++j)
+            {
+                std::copy_n(&registers[a.from[j] * num_tags], num_tags, &next[j * num_tags]);
+            }
+            registers.swap(next);
+        }
+        for (const auto &tag : a.tags)
+        {
+            registers[tag.first * num_tags + tag.second] = i + 1;
+        }
+    }
+
+    unsigned thread = m_accept[state];
+    if (thread == no_thread)
+    {
+        return false;
+    }
+    groups.assign(m_num_groups + 1, {-1, -1});
+    groups[0] = {0, size};
+    for (unsigned g = 0; g < m_num_groups; ++g)
+    {
+        auto start = registers[thread * num_tags + 2 * g];
+        auto end = registers[thread * num_tags + 2 * g + 1];
+        if (start >= 0 && end >= start)
+        {
+            groups[g + 1] = {start, end};
+        }
+    }
+    return true;
+}
+
+unsigned TaggedDFA::num_groups() const
+{
+    return m_num_groups;
+}
+
+unsigned TaggedDFA::num_states() const
+{
+    return m_num_states;
+}
+
+namespace
+{
+
+compile_options exact(compile_options options)
+{
+    // checked here, before ApproximateDFA builds anything from @options
+    if (options.max_errors > 254)
+    {
+        throw std::invalid_argument("max_errors must be at most 254");
+    }
+    options.max_errors = 0;
+    options.stride = 1;
+    return options;
+}
+
+} // namespace
+
+const unsigned ApproximateDFA::unknown;
+const unsigned ApproximateDFA::dead;
+
+ApproximateDFA::ApproximateDFA(const char *pattern, const compile_options &options)
+    : m_dfa(DFA::from_regex(pattern, exact(options))), m_limit(options.max_errors + 1),
+      m_successors(m_dfa.num_states()), m_representatives(m_dfa.num_classes())
+{
+    for (unsigned c = 0; c < 256; ++c)
+    {
+        m_representatives[m_dfa.byte_class(c)] = c;
+    }
+    const unsigned trap = m_dfa.num_states();
+    for (unsigned q = 0; q < trap; ++q)
+    {
+        auto &successors = m_successors[q];
+        for (auto c : m_representatives)
+        {
+            unsigned r = m_dfa.next_state(q, c);
+            if (r != trap)
+            {
+                successors.push_back(r);
+            }
+        }
+        std::sort(successors.begin(), successors.end());
+        successors.erase(std::unique(successors.begin(), successors.end()), successors.end());
+    }
+
+    Errors_t errors(trap, m_limit);
+    errors[m_dfa.start_state()] = 0;
+    close(errors);
+    add(std::move(errors));
+}
+
+void ApproximateDFA::close(Errors_t &errors) const
+{
+    // one pass per number of edits, since a deletion costs exactly one
+    for (unsigned e = 0; e + 1 < m_limit; ++e)
+    {
+        for (unsigned q = 0; q < errors.size(); ++q)
+        {
+            if (errors[q] != e)
+            {
+                continue;
+            }
+            for (auto r : m_successors[q])
+            {
+                errors[r] = std::min<unsigned>(errors[r], e + 1);
+            }
+        }
+    }
+}
+
+unsigned ApproximateDFA::add(Errors_t &&errors)
+{
+    if (std::all_of(errors.begin(), errors.end(), [&](unsigned char e) { return e >= m_limit; }))
+    {
+        return dead;
+    }
+    auto inserted = m_ids.emplace(errors, m_states.size());
+    if (inserted.second)
+    {
+        check_budget(m_states.size() + 1, errors.size());
+        int distance = -1;
+        for (unsigned q = 0; q < errors.size(); ++q)
+        {
+            if (errors[q] < m_limit && m_dfa.is_final(q) && (distance < 0 || errors[q] < distance))
+            {
+                distance = errors[q];
+            }
+        }
+        m_distance.push_back(distance);
+        m_states.push_back(std::move(errors));
+        m_table.resize(m_table.size() + m_representatives.size(), unknown);
+    }
+    return inserted.first->second;
+}
+
+unsigned ApproximateDFA::next(unsigned state, unsigned char byte)
+{
+    // like the DFA, never read '\0'
+    if (byte == '\0')
+    {
+        return dead;
+    }
+    std::size_t k = state * m_representatives.size() + m_dfa.byte_class(byte);
+    if (m_table[k] != unknown)
+    {
+        return m_table[k];
+    }
+
+    const auto &from = m_states[state];
+    const unsigned trap = m_dfa.num_states();
+    Errors_t errors(from.size(), m_limit);
+    for (unsigned q = 0; q < from.size(); ++q)
+    {
+        unsigned e = from[q];
+        if (e >= m_limit)
+        {
+            continue;
+        }
+        unsigned r = m_dfa.next_state(q, byte);
+        if (r != trap)
+        {
+            errors[r] = std::min<unsigned>(errors[r], e);
+        }
+        if (e + 1 < m_limit)
+        {
+            // insert the byte, or substitute it for any byte the pattern reads here
+            errors[q] = std::min<unsigned>(errors[q], e + 1);
+            for (auto s : m_successors[q])
+            {
+                errors[s] = std::min<unsigned>(errors[s], e + 1);
+            }
+        }
+    }
+    close(errors);
+    unsigned q = add(std::move(errors));
+    m_table[k] = q;
+    return q;
+}
+
+int ApproximateDFA::distance(const char *data, std::size_t size)
+{
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    unsigned state = 0;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        state = next(state, tape[i]);
+        if (state == dead)
+        {
+            return -1;
+        }
+    }
+    return m_distance[state];
+}
+
+unsigned ApproximateDFA::num_states() const
+{
+    return m_states.size();
+}
+
+DFA ApproximateDFA::determinize()
+{
+    phase_scope phase(Phase::determinize);
+    std::vector<unsigned char> classes(256);
+    for (unsigned c = 0; c < 256; ++c)
+    {
+        classes[c] = m_dfa.byte_class(c);
+    }
+    uint_set F;
+    DFA::Rules_t R;
+    std::vector<unsigned> targets(m_representatives.size());
+    for (unsigned p = 0; p < m_states.size(); ++p)
+    {
+        if (m_distance[p] >= 0)
+        {
+            F.add(p);
+        }
+        for (unsigned k = 0; k < m_representatives.size(); ++k)
+        {
+            targets[k] = next(p, m_representatives[k]);
+        }
+        add_rules(R, p, classes, targets, dead);
+    }
+    return DFA(0, F, R).minimize();
+}
+
+struct LazyDFA::nfa
+{
+    tagged_nfa graph;
+    unsigned accept;
+};
+
+const unsigned LazyDFA::unknown;
+const unsigned LazyDFA::dead;
+const unsigned LazyDFA::full;
+const unsigned LazyDFA::chunk_size;
+
+LazyDFA::LazyDFA(const char *pattern, const compile_options &options)
+    : m_nfa(new nfa), m_classes(256), m_capacity(options.max_states ? options.max_states : 1 << 16)
+{
+    auto now = clock_type::now();
+    compile_context context{&options, now, uint_set::usage().current, nullptr, Phase::parse, now};
+    context_scope scope(&context);
+
+    // the tags of the groups are not needed to decide a match
+    tagged_nfa_builder builder(m_nfa->graph, options);
+    const auto fragment = parse(pattern, options, builder);
+    m_nfa->accept = fragment.end;
+
+    bool cut[257] = {true, true};
+    for (const auto &ranges : m_nfa->graph.ranges)
+    {
+        for (const auto &r : ranges)
+        {
+            cut[r.a] = true;
+            cut[r.b + 1] = true;
+        }
+    }
+    for (unsigned c = 0; c < 256; ++c)
+    {
+        if (cut[c])
+        {
+            m_representatives.push_back(c);
+        }
+        m_classes[c] = m_representatives.size() - 1;
+    }
+    m_num_classes = m_representatives.size();
+
+    unsigned slots = 2;
+    while (slots < 2 * m_capacity)
+    {
+        slots *= 2;
+    }
+    m_mask = slots - 1;
+    m_slots.reset(new std::atomic<unsigned>[slots]);
+    for (unsigned i = 0; i < slots; ++i)
+    {
+        m_slots[i].store(unknown, std::memory_order_relaxed);
+    }
+    const unsigned num_chunks = (m_capacity + chunk_size - 1) / chunk_size;
+    m_chunks.reset(new std::atomic<state *>[num_chunks]);
+    for (unsigned i = 0; i < num_chunks; ++i)
+    {
+        m_chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    Set_t start{fragment.start};
+    close(start);
+    m_start = intern(std::move(start));
+}
+
+LazyDFA::~LazyDFA()
+{
+    for (unsigned i = 0; i < (m_capacity + chunk_size - 1) / chunk_size; ++i)
+    {
+        delete[] m_chunks[i].load(std::memory_order_relaxed);
+    }
+}
+
+void LazyDFA::close(Set_t &set) const
+{
+    // keep the states that read a byte or accept, which are all that tell sets apart
+    const auto &graph = m_nfa->graph;
+    std::vector<bool> seen(graph.size());
+    Set_t stack(set);
+    set.clear();
+    while (!stack.empty())
+    {
+        unsigned q = stack.back();
+        stack.pop_back();
+        if (seen[q])
+        {
+            continue;
+        }
+        seen[q] = true;
+        if (!graph.ranges[q].empty() || q == m_nfa->accept)
+        {
+            set.push_back(q);
+        }
+        for (const auto &e : graph.epsilons[q])
+        {
+            stack.push_back(e.q);
+        }
+    }
+    std::sort(set.begin(), set.end());
+}
+
+LazyDFA::Set_t LazyDFA::step(const Set_t &from, unsigned char byte) const
+{
+    Set_t to;
+    for (auto q : from)
+    {
+        for (const auto &r : m_nfa->graph.ranges[q])
+        {
+            if (r.a <= byte && byte <= r.b)
+            {
+                to.push_back(r.q);
+            }
+        }
+    }
+    close(to);
+    return to;
+}
+
+LazyDFA::state &LazyDFA::at(unsigned id) const
+{
+    return m_chunks[id / chunk_size].load(std::memory_order_acquire)[id % chunk_size];
+}
+
+unsigned LazyDFA::intern(Set_t &&set) const
+{
+    if (set.empty())
+    {
+        return dead;
+    }
+    std::size_t hash = set.size();
+    for (auto q : set)
+    {
+        hash = hash * 1000003 ^ q;
+    }
+    unsigned i = hash & m_mask;
+    for (;; i = (i + 1) & m_mask)
+    {
+        unsigned id = m_slots[i].load(std::memory_order_acquire);
+        if (id == unknown)
+        {
+            break;
+        }
+        if (at(id).set == set)
+        {
+            return id;
+        }
+    }
+
+    // build the state under a fresh id, then publish it in the first free slot; the count stops
+    // at the capacity, so that no id is ever handed out twice
+    unsigned id = m_count.load(std::memory_order_relaxed);
+    do
+    {
+        if (id >= m_capacity)
+        {
+            return full;
+        }
+    } while (!m_count.compare_exchange_weak(id, id + 1, std::memory_order_relaxed));
+    auto &chunk = m_chunks[id / chunk_size];
+    state *states = chunk.load(std::memory_order_acquire);
+    if (!states)
+    {
+        auto fresh = new state[chunk_size];
+        if (chunk.compare_exchange_strong(states, fresh, std::memory_order_acq_rel))
+        {
+            states = fresh;
+        }
+        else
+        {
+            delete[] fresh;
+        }
+    }
+    state &q = states[id % chunk_size];
+    q.final = std::binary_search(set.begin(), set.end(), m_nfa->accept);
+    q.next.reset(new std::atomic<unsigned>[m_num_classes]);
+    for (unsigned k = 0; k < m_num_classes; ++k)
+    {
+        q.next[k].store(unknown, std::memory_order_relaxed);
+    }
+    q.set = std::move(set);
+    for (;; i = (i + 1) & m_mask)
+    {
+        unsigned expected = unknown;
+        if (m_slots[i].compare_exchange_strong(expected, id, std::memory_order_acq_rel))
+        {
+            return id;
+        }
+        if (at(expected).set == q.set)
+        {
+            // another thread published the same set first; id is left unused
+            return expected;
+        }
+    }
+}
+
+bool LazyDFA::match(const char *data, std::size_t size) const
+{
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    unsigned id = m_start;
+    if (id == dead)
+    {
+        return false;
+    }
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        const state &q = at(id);
+        auto &slot = q.next[m_classes[tape[i]]];
+        unsigned next = slot.load(std::memory_order_acquire);
+        if (next == unknown)
+        {
+            next = intern(step(q.set, tape[i]));
+            // a racing thread can only have stored the same id, or full if it found no room
+            // just before this one built the state; full stays, so later misses skip intern
+            unsigned expected = unknown;
+            slot.compare_exchange_strong(expected, next, std::memory_order_acq_rel);
+        }
+        if (next == full)
+        {
+            // out of room: simulate the NFA on the rest
+            Set_t set = step(q.set, tape[i]);
+            for (++i; i < size && !set.empty(); ++i)
+            {
+                set = step(set, tape[i]);
+            }
+            return std::binary_search(set.begin(), set.end(), m_nfa->accept);
+        }
+        if (next == dead)
+        {
+            return false;
+        }
+        id = next;
+    }
+    return at(id).final;
+}
+
+unsigned LazyDFA::num_states() const
+{
+    return m_count.load(std::memory_order_relaxed);
+}
+
+const unsigned Lexer::no_token;
+
+Lexer::Lexer(const std::vector<std::string> &patterns, const compile_options &options) : m_classes(256)
+{
+    auto dfas = compile_many(patterns, options);
+    for (auto &dfa : dfas)
+    {
+        dfa = dfa.minimize();
+    }
+
+    auto now = clock_type::now();
+    compile_context context{&options, now, uint_set::usage().current, nullptr, Phase::determinize, now};
+    context_scope scope(&context);
+
+    // bytes of the same class in every DFA form one class
+    std::map<std::vector<unsigned>, unsigned> class_of;
+    std::vector<unsigned char> representatives;
+    for (unsigned c = 0; c < 256; ++c)
+    {
+        std::vector<unsigned> signature;
+        for (const auto &dfa : dfas)
+        {
+            signature.push_back(dfa.byte_class(c));
+        }
+        auto inserted = class_of.emplace(signature, class_of.size());
+        if (inserted.second)
+        {
+            representatives.push_back(c);
+        }
+        m_classes[c] = inserted.first->second;
+    }
+    m_num_classes = representatives.size();
+
+    // the reachable tuples of states, the trap of every DFA excluded
+    typedef std::vector<unsigned> Tuple_t;
+    std::map<Tuple_t, unsigned> ids;
+    std::vector<Tuple_t> states;
+    Tuple_t start;
+    Tuple_t traps;
+    for (const auto &dfa : dfas)
+    {
+        start.push_back(dfa.start_state());
+        traps.push_back(dfa.num_states());
+    }
+    ids.emplace(start, 0);
+    states.push_back(start);
+    std::vector<unsigned> next;
+    for (unsigned p = 0; p < states.size(); ++p)
+    {
+        unsigned accept = no_token;
+        for (unsigned i = 0; i < dfas.size() && accept == no_token; ++i)
+        {
+            if (dfas[i].is_final(states[p][i]))
+            {
+                accept = i;
+            }
+        }
+        m_accept.push_back(accept);
+        next.clear();
+        for (auto c : representatives)
+        {
+            Tuple_t tuple(dfas.size());
+            for (unsigned i = 0; i < dfas.size(); ++i)
+            {
+                tuple[i] = dfas[i].next_state(states[p][i], c);
+            }
+            if (tuple == traps)
+            {
+                next.push_back(no_token);
+                continue;
+            }
+            auto inserted = ids.emplace(tuple, states.size());
+            if (inserted.second)
+            {
+                check_budget(states.size() + 1);
+                states.push_back(std::move(tuple));
+            }
+            next.push_back(inserted.first->second);
+        }
+        m_table.insert(m_table.end(), next.begin(), next.end());
+    }
+    for (auto &q : m_table)
+    {
+        q = q == no_token ? states.size() : q;
+    }
+}
+
+std::size_t Lexer::tokenize(const char *data, std::size_t size, std::vector<token> &tokens) const
+{
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    const unsigned trap = m_accept.size();
+    auto key = [&](std::size_t i, unsigned q) { return static_cast<unsigned long long>(i) * trap + q; };
+    // (position, state) pairs from which no token ends, and the furthest position read
+    std::unordered_set<unsigned long long> failed;
+    std::size_t scanned = 0;
+    std::vector<std::pair<std::size_t, unsigned>> overshoot;
+    std::size_t start = 0;
+    while (start < size)
+    {
+        unsigned id = no_token;
+        std::size_t end = start;
+        unsigned state = 0;
+        std::size_t i = start;
+        overshoot.clear();
+        while (i < size)
+        {
+            state = m_table[state * m_num_classes + m_classes[tape[i]]];
+            ++i;
+            if (state == trap || (i <= scanned && !failed.empty() && failed.count(key(i, state))))
+            {
+                break;
+            }
+            if (m_accept[state] != no_token)
+            {
+                id = m_accept[state];
+                end = i;
+                overshoot.clear();
+            }
+            else
+            {
+                overshoot.emplace_back(i, state);
+            }
+        }
+        scanned = std::max(scanned, i);
+        for (const auto &x : overshoot)
+        {
+            failed.insert(key(x.first, x.second));
+        }
+        if (id == no_token)
+        {
+            return start;
+        }
+        tokens.push_back({id, start, end});
+        start = end;
+    }
+    return size;
+}
+
+unsigned Lexer::num_states() const
+{
+    return m_accept.size();
+}
+
+std::vector<unsigned> PatternSet::Version::match(const char *data, std::size_t size) const
+{
+    const unsigned trap = m_states.size();
+    const unsigned width = m_num_classes;
+    const unsigned *table = m_table.data();
+    const unsigned char *classes = m_classes.data();
+    auto tape = reinterpret_cast<const unsigned char *>(data);
+    unsigned state = 0;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        state = table[state * width + classes[tape[i]]];
+        if (state == trap)
+        {
+            return {};
+        }
+    }
+    return m_accepts[state];
+}
+
+std::size_t PatternSet::Version::size() const
+{
+    return m_patterns.size();
+}
+
+unsigned PatternSet::Version::num_states() const
+{
+    return m_states.size();
+}
+
+unsigned PatternSet::Version::built_states() const
+{
+    return m_built_states;
+}
+
+PatternSet::PatternSet()
+{
+    publish({});
+}
+
+unsigned PatternSet::add(const char *pattern, const compile_options &options)
+{
+    auto dfa = std::make_shared<const DFA>(compile(pattern, options));
+    std::lock_guard<std::mutex> lock(m_update);
+    auto patterns = m_current->m_patterns;
+    unsigned id = m_next_id++;
+    patterns.emplace(id, std::move(dfa));
+    publish(std::move(patterns));
+    return id;
+}
+
+std::vector<unsigned> PatternSet::add(const std::vector<std::string> &patterns, const compile_options &options)
+{
+    auto dfas = compile_many(patterns, options);
+    std::lock_guard<std::mutex> lock(m_update);
+    auto next = m_current->m_patterns;
+    std::vector<unsigned> ids;
+    for (auto &dfa : dfas)
+    {
+        ids.push_back(m_next_id++);
+        next.emplace(ids.back(), std::make_shared<const DFA>(std::move(dfa)));
+    }
+    publish(std::move(next));
+    return ids;
+}
+
+void PatternSet::remove(unsigned id)
+{
+    std::lock_guard<std::mutex> lock(m_update);
+    auto patterns = m_current->m_patterns;
+    if (patterns.erase(id) == 0)
+    {
+        throw std::out_of_range("unknown pattern id");
+    }
+    publish(std::move(patterns));
+}
+
+std::shared_ptr<const PatternSet::Version> PatternSet::current() const
+{
+    return std::atomic_load(&m_current);
+}
+
+void PatternSet::publish(std::map<unsigned, std::shared_ptr<const DFA>> &&patterns)
+{
+    typedef Version::State_t State_t;
+    auto previous = m_current;
+    auto version = std::make_shared<Version>();
+    version->m_patterns = std::move(patterns);
+
+    // the byte classes are the bytes no pattern tells apart; they refine those of the
+    // previous version on every pattern still present, so its rows stay valid
+    std::map<std::vector<unsigned>, unsigned> class_of_signature;
+    std::vector<unsigned char> representatives;
+    version->m_classes.resize(256);
+    for (unsigned c = 0; c < 256; ++c)
+    {
+        std::vector<unsigned> signature;
+        for (const auto &kv : version->m_patterns)
+        {
+            signature.push_back(kv.second->byte_class(c));
+        }
+        auto inserted = class_of_signature.emplace(signature, representatives.size());
+        if (inserted.second)
+        {
+            representatives.push_back(c);
+        }
+        version->m_classes[c] = inserted.first->second;
+    }
+    const unsigned width = version->m_num_classes = representatives.size();
+
+    const unsigned trap = ~0u;
+    auto &ids = version->m_ids;
+    auto &states = version->m_states;
+    auto &table = version->m_table;
+    std::vector<unsigned> id_of_previous(previous ? previous->m_states.size() : 0, trap);
+    auto state_id = [&](const State_t &state) {
+        auto inserted = ids.emplace(state, states.size());
+        if (inserted.second)
+        {
+            states.push_back(state);
+            if (previous)
+            {
+                auto it = previous->m_ids.find(state);
+                if (it != previous->m_ids.end())
+                {
+                    id_of_previous[it->second] = inserted.first->second;
+                }
+            }
+        }
+        return inserted.first->second;
+    };
+
+    State_t start;
+    for (const auto &kv : version->m_patterns)
+    {
+        start.emplace_back(kv.first, kv.second->start_state());
+    }
+    state_id(start);
+    for (unsigned p = 0; p < states.size(); ++p)
+    {
+        // a state of the previous version keeps its transitions; its successors involve only
+        // patterns it involves, so they are in the previous version too
+        unsigned r = trap;
+        if (previous)
+        {
+            auto it = previous->m_ids.find(states[p]);
+            r = it != previous->m_ids.end() ? it->second : trap;
+        }
+        if (r != trap)
+        {
+            const unsigned previous_trap = previous->m_states.size();
+            for (unsigned k = 0; k < width; ++k)
+            {
+                unsigned q = previous->m_table[r * previous->m_num_classes + previous->m_classes[representatives[k]]];
+                if (q == previous_trap)
+                {
+                    table.push_back(trap);
+                }
+                else if (id_of_previous[q] != trap)
+                {
+                    table.push_back(id_of_previous[q]);
+                }
+                else
+                {
+                    table.push_back(state_id(previous->m_states[q]));
+                }
+            }
+            version->m_accepts.push_back(previous->m_accepts[r]);
+            continue;
+        }
+
+        ++version->m_built_states;
+        std::vector<unsigned> accepts;
+        for (const auto &x : states[p])
+        {
+            if (version->m_patterns.at(x.first)->is_final(x.second))
+            {
+                accepts.push_back(x.first);
+            }
+        }
+        version->m_accepts.push_back(std::move(accepts));
+        for (unsigned k = 0; k < width; ++k)
+        {
+            State_t next;
+            for (const auto &x : states[p])
+            {
+                const auto &dfa = *version->m_patterns.at(x.first);
+                unsigned q = dfa.next_state(x.second, representatives[k]);
+                if (q != dfa.num_states())
+                {
+                    next.emplace_back(x.first, q);
+                }
+            }
+            table.push_back(next.empty() ? trap : state_id(next));
+        }
+    }
+
+    // the trap row, now that the number of states is known
+    for (auto &q : table)
+    {
+        if (q == trap)
+        {
+            q = states.size();
+        }
+    }
+    table.insert(table.end(), width, states.size());
+
+    std::atomic_store(&m_current, std::shared_ptr<const Version>(std::move(version)));
+}
+
 } // namespace RegEx
@@ -3,29 +3,103 @@
 
 #include "uint_set.hpp"
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace RegEx
 {
 
+class ParsingException : public std::exception
+{
+public:
+    ParsingException(const char *msg) : m_msg(msg)
+    {
+    }
+
+    const char *what() const throw() override
+    {
+        return m_msg;
+    }
+
+private:
+    const char *m_msg;
+};
+
+/**
+ * Thrown by RegEx::compile when it exceeds a limit set in compile_options.
+ */
+class BudgetException : public std::exception
+{
+public:
+    enum class Budget
+    {
+        states,
+        memory,
+        time,
+    };
+
+    BudgetException(Budget budget) : m_budget(budget)
+    {
+    }
+
+    Budget budget() const
+    {
+        return m_budget;
+    }
+
+    const char *what() const throw() override
+    {
+        switch (m_budget)
+        {
+        case Budget::states:
+            return "DFA state budget exceeded";
+        case Budget::memory:
+            return "memory budget exceeded";
+        case Budget::time:
+            return "time budget exceeded";
+        }
+        return "budget exceeded";
+    }
+
+private:
+    Budget m_budget;
+};
+
+struct compile_options;
+
 class DFA
 {
 public:
+    /**
+     * Move from state p to state q on reading any byte in [a, b].
+     * A rule with a == '\0' is an epsilon move; '\0' is never read.
+     */
     struct transition_rule
     {
         transition_rule() = default;
         transition_rule(unsigned, char, unsigned);
+        transition_rule(unsigned, char, char, unsigned);
         unsigned p;
         char a;
+        char b;
         unsigned q;
     };
 
     struct transition_rule_set
     {
         transition_rule_set() = default;
-        transition_rule_set(const uint_set &, char, const uint_set &);
+        transition_rule_set(const uint_set &, char, char, const uint_set &);
         uint_set p;
         char a;
+        char b;
         uint_set q;
     };
 
@@ -54,6 +128,21 @@ public:
 
     static DFA from_regex(const char *regex);
 
+    static DFA from_regex(const char *regex, const compile_options &options);
+
+    /**
+     * The number of states, not counting the implicit trap state.
+     */
+    unsigned num_states() const;
+
+    /**
+     * The number of byte classes, i.e. the width of the transition table.
+     * Bytes in the same class move every state to the same state.
+     */
+    unsigned num_classes() const;
+
+    const Rules_t &rules() const;
+
     void reset();
 
     void advance(char a);
@@ -62,26 +151,835 @@ public:
 
     bool match(const char *string);
 
-    DFA kleene_star() const;
+    /**
+     * Match the @size bytes starting at @data, which need not be null-terminated.
+     * Does not touch the state used by advance(), so a single DFA can be shared by many threads.
+     */
+    bool match(const char *data, std::size_t size) const;
+
+    /**
+     * Whether the @size bytes starting at @data can still be completed into a string this DFA
+     * matches. Like the match functions below, stops reading as soon as the answer is known:
+     * at a dead state, from which nothing is matched, or at an absorbing state, final states
+     * that every non-null byte leads to.
+     */
+    bool is_match_prefix(const char *data, std::size_t size) const;
+
+    /**
+     * The length of the shortest prefix of the @size bytes starting at @data that this DFA
+     * matches, or -1 if there is none.
+     */
+    std::ptrdiff_t earliest_match(const char *data, std::size_t size) const;
+
+    /**
+     * Match like match(@data, @size), and count in @visits (grown to num_states() if shorter)
+     * how many times each state is entered, the start state included.
+     */
+    bool profile(const char *data, std::size_t size, std::vector<unsigned long long> &visits) const;
+
+    /**
+     * The same DFA with its reachable states renumbered in breadth-first order from the start,
+     * or by decreasing count in @visits as gathered by profile(), ties in breadth-first order,
+     * so that the rows of the transition table used most sit together.
+     */
+    DFA reorder() const;
+
+    DFA reorder(const std::vector<unsigned long long> &visits) const;
+
+    /**
+     * The bytes held by the transition table.
+     */
+    std::size_t table_bytes() const;
+
+    /**
+     * The size of a state id in the transition table: 1, 2 or 4 bytes, the narrowest that
+     * holds every state and the trap.
+     */
+    unsigned state_bytes() const;
+
+    /**
+     * The bytes match() consumes per table lookup: 2 once a stride-2 table has been built
+     * (see compile_options::stride), otherwise 1.
+     */
+    unsigned stride() const;
+
+    /**
+     * Stepping through the transition table by hand: the state after reading @byte in state @q.
+     * num_states() stands for the trap state, which never leaves itself and is not final.
+     */
+    unsigned start_state() const;
+
+    /**
+     * Bytes of the same class lead every state to the same state.
+     */
+    unsigned byte_class(unsigned char byte) const;
+
+    unsigned next_state(unsigned q, unsigned char byte) const;
+
+    bool is_final(unsigned q) const;
+
+    /**
+     * No string leads state @q to a final state. The trap state is dead.
+     */
+    bool is_dead(unsigned q) const;
+
+    /**
+     * State @q is final and so is every state reached from it by non-null bytes.
+     */
+    bool is_absorbing(unsigned q) const;
+
+    /**
+     * The operations below reuse the rules of an rvalue left operand instead of copying them.
+     */
+    DFA kleene_star() const &;
+
+    DFA kleene_star() &&;
+
+    DFA concatenation(const DFA &other) const &;
+
+    DFA concatenation(const DFA &other) &&;
+
+    DFA alternation(const DFA &other) const &;
+
+    DFA alternation(const DFA &other) &&;
+
+    /**
+     * Boolean operations by product construction over the transition tables, followed by
+     * minimization: match what both DFAs match, or what this one matches but @other does not.
+     */
+    DFA intersection(const DFA &other) const;
+
+    DFA difference(const DFA &other) const;
+
+    /**
+     * Match every string of non-null bytes this DFA does not match.
+     */
+    DFA complement() const;
 
-    DFA concatenation(const DFA &other) const;
+    /**
+     * The equivalent DFA with the fewest states.
+     */
+    DFA minimize() const;
 
-    DFA alternation(const DFA &other) const;
+    static const unsigned unbounded = ~0u;
+
+    /**
+     * Match @min to @max consecutive strings of this DFA; @max may be DFA::unbounded.
+     * All copies go into one NFA, determinized once.
+     */
+    DFA repeat(unsigned min, unsigned max) const;
 
 private:
-    static void _eval(Operator op, std::vector<DFA> &v_stack) throw();
+    /**
+     * Implementations of the operations above; @R holds the rules of this DFA and is consumed.
+     */
+    DFA kleene_star(Rules_t &R) const;
+
+    DFA concatenation(Rules_t &R, const DFA &other) const;
+
+    DFA alternation(Rules_t &R, const DFA &other) const;
+
+    static DFA _parse(const char *regex, const compile_options &options, uint_set_arena &arena);
+
+    enum class Product : char
+    {
+        intersection,
+        difference,
+    };
+
+    DFA product(const DFA &other, Product op) const;
+
+    /**
+     * The DFA whose state i is state @order[i] of this one; states not in @order are dropped.
+     */
+    DFA renumber(const std::vector<unsigned> &order) const;
+
+    void build_table();
+
+    /**
+     * Fill m_flags from the transition table.
+     */
+    void classify_states();
+
+    /**
+     * The answer of a match that reached the dead or absorbing @state with the @size bytes at
+     * @rest still unread.
+     */
+    bool settle(unsigned state, const unsigned char *rest, std::size_t size) const;
+
+    /**
+     * Entry @index of the transition table, whatever its width.
+     */
+    unsigned transition(std::size_t index) const;
+
+    /**
+     * Build the stride-2 table if it takes at most @max_bytes.
+     */
+    void build_pair_table(std::size_t max_bytes);
+
+    template <class State>
+    struct table_t
+    {
+        /**
+         * Indexed by state * m_num_classes + byte class.
+         */
+        std::vector<State> single;
+        /**
+         * Indexed by (state * m_num_classes + class of the first byte) * m_num_classes
+         * + class of the second byte; empty unless built.
+         */
+        std::vector<State> pairs;
+    };
+
+    template <class State>
+    bool match(const table_t<State> &table, const char *data, std::size_t size) const;
+
+    template <class State>
+    void build_pair_table(table_t<State> &table, std::size_t max_bytes);
 
     unsigned m_s;
     uint_set m_F;
     Rules_t m_R;
 
     unsigned m_num_states;
+    unsigned m_num_classes;
+    /**
+     * The byte class of each byte.
+     */
+    std::vector<unsigned char> m_classes;
+    /**
+     * Dense transition tables. Row m_num_states is the trap state, which loops to itself.
+     * Only the one of state_bytes() wide entries is filled.
+     */
+    table_t<std::uint8_t> m_table8;
+    table_t<std::uint16_t> m_table16;
+    table_t<std::uint32_t> m_table32;
+    static const unsigned char final_flag = 1;
+    static const unsigned char dead_flag = 2;
+    static const unsigned char absorbing_flag = 4;
+    /**
+     * The flags of each state, the trap included, so the match loops need not consult m_F.
+     */
+    std::vector<unsigned char> m_flags;
     unsigned m_state;
     bool m_trapped;
 };
 
+/**
+ * What RegEx::compile did to build a DFA.
+ * The pattern is compiled operator by operator, each step determinizing its own NFA,
+ * so the NFA figures are totals over all steps.
+ */
+struct compile_stats
+{
+    unsigned nfa_states{0};
+    unsigned nfa_rules{0};
+    unsigned dfa_states{0};
+    unsigned dfa_rules{0};
+    /**
+     * The states left by minimization when compile_options::minimize is set, otherwise 0;
+     * dfa_states counts them before.
+     */
+    unsigned minimized_states{0};
+    unsigned determinizations{0};
+    unsigned subset_iterations{0};
+    unsigned closure_calls{0};
+    /**
+     * Subexpressions whose DFA was reused from an identical earlier one instead of being built.
+     */
+    unsigned shared_subexpressions{0};
+    /**
+     * The most bytes held by uint_sets at any time during compilation.
+     */
+    long long peak_set_bytes{0};
+
+    /**
+     * Wall time spent exclusively in each phase, in seconds.
+     */
+    double parse_seconds{0};
+    double construct_seconds{0};
+    double determinize_seconds{0};
+    double minimize_seconds{0};
+    double table_seconds{0};
+};
+
+/**
+ * How RegEx::compile turns the pattern into a DFA.
+ */
+enum class Construction
+{
+    subsets,     // build an NFA for every operator and determinize it by subset construction
+    derivatives, // build one term, then explore its Brzozowski derivatives
+};
+
+/**
+ * How RegEx::compile reads the pattern, and limits on the resources it may use.
+ * A limit of 0 means unlimited; exceeding one aborts compilation with a BudgetException.
+ */
+struct compile_options
+{
+    /**
+     * Read the pattern as UTF-8: literals, '.', classes and \p{...} categories stand for
+     * code points, which the DFA matches as their UTF-8 byte sequences.
+     */
+    bool utf8{false};
+
+    /**
+     * Match letters regardless of case: ASCII letters, or in UTF-8 mode every code point
+     * with a Unicode simple case folding. Cases are merged into the same transitions.
+     */
+    bool case_insensitive{false};
+
+    /**
+     * Read the pattern in the basic syntax of the Python implementation: only '(', ')', '|'
+     * and '*' are operators, and every other character, '.', '+', '[' or '\\' included, is
+     * a literal.
+     */
+    bool basic_syntax{false};
+
+    Construction construction{Construction::subsets};
+
+    /**
+     * 2 to also build a table that reads two bytes per lookup, halving the chain of dependent
+     * loads on long inputs. It is skipped when it would exceed max_stride_bytes, since it grows
+     * with the square of the number of byte classes.
+     */
+    unsigned stride{1};
+    std::size_t max_stride_bytes{1 << 20};
+
+    /**
+     * Match strings within this many edits of the pattern (byte insertions, deletions and
+     * substitutions), at most 254. See ApproximateDFA.
+     */
+    unsigned max_errors{0};
+
+    /**
+     * Minimize the DFA before building its tables, so it has as few states as any DFA of its
+     * language. Usually worth it for patterns matched many times; see compile_stats.
+     */
+    bool minimize{false};
+
+    /**
+     * The most states of any DFA built along the way, including intermediate ones.
+     */
+    unsigned max_states{0};
+    /**
+     * The most bytes held at once by state sets and the transition table being built.
+     */
+    std::size_t max_memory{0};
+    double max_seconds{0};
+};
+
 bool match(const char *pattern, const char *str);
 
-DFA compile(const char *pattern);
+/**
+ * Compile @pattern into a DFA. If @stats is given, it is filled with what compilation did.
+ */
+DFA compile(const char *pattern, compile_stats *stats = nullptr);
+
+DFA compile(const char *pattern, const compile_options &options, compile_stats *stats = nullptr);
+
+/**
+ * Compile each of @patterns like compile(), on @threads threads (0 for one per core).
+ * Identical patterns are compiled once. If any pattern fails to compile, the exception of
+ * the first one is rethrown once all are done.
+ */
+std::vector<DFA> compile_many(const std::vector<std::string> &patterns, const compile_options &options = compile_options(),
+                              unsigned threads = 0);
+
+/**
+ * A DFA's transition table packed by row displacement, for automata too big to keep dense.
+ *
+ * Each state keeps a fallback target, its most common one (often the trap), and only the
+ * transitions that differ from it. Those rows are overlaid into one array at per-state
+ * offsets such that no two of them use the same slot. A slot holds a state id as wide as in
+ * the dense table and a check byte, the state's id modulo 255; states sharing a check byte
+ * are placed so that their rows never overlap, so the byte tells whether a slot belongs to
+ * the state reading it. Reading a byte costs a fixed number of loads: its class, the state's
+ * offset, fallback and check byte, and one slot.
+ *
+ * The packed table pays off when most states have few transitions besides their fallback,
+ * as in keyword lists. With few byte classes, or rows that mostly differ, every state costs
+ * its row header on top of its entries and the table ends up bigger than the dense one,
+ * which is also faster: compare table_bytes() with DFA::table_bytes() to choose.
+ */
+class CompressedDFA
+{
+public:
+    explicit CompressedDFA(const DFA &dfa);
+
+    /**
+     * Match the @size bytes starting at @data, like DFA::match.
+     */
+    bool match(const char *data, std::size_t size) const;
+
+    unsigned num_states() const;
+
+    /**
+     * The bytes held by the packed table, to compare with DFA::table_bytes().
+     */
+    std::size_t table_bytes() const;
+
+private:
+    template <class State>
+    struct row_t
+    {
+        unsigned base;
+        State fallback;
+        unsigned char check;
+    };
+
+    template <class State>
+    struct slot_t
+    {
+        State next;
+        /**
+         * The check byte of the state owning the slot, or free.
+         */
+        unsigned char check;
+    };
+
+    template <class State>
+    struct table_t
+    {
+        std::vector<row_t<State>> rows;
+        std::vector<slot_t<State>> slots;
+    };
+
+    static const unsigned char free = 255;
+
+    /**
+     * Fill @table with the rows starting at @bases, of the states in @fallbacks, and the
+     * transitions owned by state @owners[i] in @slots, unowned where ~0u.
+     */
+    template <class State>
+    static void fill(table_t<State> &table, const std::vector<unsigned> &bases, const std::vector<unsigned> &fallbacks,
+                     const std::vector<unsigned> &owners, const std::vector<unsigned> &slots);
+
+    template <class State>
+    bool match(const table_t<State> &table, const char *data, std::size_t size) const;
+
+    template <class State>
+    std::size_t table_bytes(const table_t<State> &table) const;
+
+    unsigned m_start;
+    unsigned m_trap;
+    std::vector<unsigned char> m_classes;
+    /**
+     * Only the narrowest one whose state ids hold the trap is filled.
+     */
+    table_t<std::uint8_t> m_table8;
+    table_t<std::uint16_t> m_table16;
+    table_t<std::uint32_t> m_table32;
+    std::vector<bool> m_final;
+};
+
+/**
+ * Many small DFAs run side by side on the same input, one byte shuffle per byte for all of them.
+ *
+ * The automata are packed into banks of bank_states states. State 0 of a bank is the trap its
+ * automata share, and each automaton takes as many of the others as it has states. For every
+ * byte a bank keeps the next state of each of its states, so shuffling that row by a vector
+ * holding the current state of each automaton in its own byte lane (pshufb) advances them all.
+ * Banks go by pairs, which AVX2 shuffles at once and SSSE3 as two independent chains; without
+ * either, each automaton walks the same tables on its own.
+ */
+class ShuffleDFA
+{
+public:
+    static const unsigned bank_states = 16;
+
+    /**
+     * Pack @dfas, each of which must have fewer than bank_states states once minimized.
+     */
+    explicit ShuffleDFA(const std::vector<DFA> &dfas);
+
+    /**
+     * The indices in the constructor's list of the automata matching the @size bytes starting
+     * at @data, in increasing order.
+     */
+    std::vector<unsigned> match(const char *data, std::size_t size) const;
+
+    /**
+     * The number of automata.
+     */
+    std::size_t size() const;
+
+    unsigned num_banks() const;
+
+private:
+    static const unsigned pair_bytes = 2 * bank_states;
+    static const unsigned unused = ~0u;
+
+    unsigned m_num_banks;
+    std::size_t m_size;
+    /**
+     * Row c of pair p, at (p * 256 + c) * pair_bytes, holds the next states on byte c of the
+     * states of both banks.
+     */
+    std::vector<unsigned char> m_tables;
+    /**
+     * pair_bytes per pair, like the rows: the start state and the automaton (or unused) of each
+     * lane, and 0xFF for each final state.
+     */
+    std::vector<unsigned char> m_starts;
+    std::vector<unsigned> m_owners;
+    std::vector<unsigned char> m_finals;
+};
+
+/**
+ * A DFA that also reports where each parenthesized group matched, without backtracking.
+ *
+ * Every '(' opens a capturing group, numbered from 1 in order of its '('. The tagged NFA of the
+ * pattern records the position at which each group opens and closes; its subset construction
+ * keeps the threads of a state in priority order, and each transition carries which thread of
+ * the previous state every thread continues and which tags it sets (Laurikari's tagged DFA,
+ * with one register row per thread). Matching is a single pass that copies register rows.
+ * Submatches are those of a backtracking matcher: alternatives are tried left to right,
+ * repetitions are greedy, and a group repeated keeps its last iteration. Unlike one, an
+ * iteration of '*' or '+' that matches the empty string ends the loop without being counted:
+ * "(a*)*" on "" leaves group 1 unset.
+ */
+class TaggedDFA
+{
+public:
+    /**
+     * Byte offsets (start, end) of the whole match and of each group, (-1, -1) for a group
+     * that did not take part.
+     */
+    typedef std::vector<std::pair<std::ptrdiff_t, std::ptrdiff_t>> Groups_t;
+
+    explicit TaggedDFA(const char *pattern, const compile_options &options = compile_options());
+
+    /**
+     * Match all @size bytes starting at @data; on success fill @groups with num_groups() + 1 spans.
+     */
+    bool match(const char *data, std::size_t size, Groups_t &groups) const;
+
+    unsigned num_groups() const;
+
+    unsigned num_states() const;
+
+private:
+    static const unsigned no_thread = ~0u;
+
+    struct action
+    {
+        /**
+         * The thread of the previous state each thread continues.
+         */
+        std::vector<unsigned> from;
+        /**
+         * (thread, tag) pairs set to the current position.
+         */
+        std::vector<std::pair<unsigned, unsigned>> tags;
+        /**
+         * Every thread continues the one at the same index, so no row moves.
+         */
+        bool identity;
+    };
+
+    unsigned m_num_groups{0};
+    unsigned m_num_states{0};
+    unsigned m_num_classes{0};
+    unsigned m_max_threads{0};
+    std::vector<unsigned char> m_classes;
+    /**
+     * Indexed by state * m_num_classes + byte class; m_num_states is the trap state.
+     * The start state is 0.
+     */
+    std::vector<unsigned> m_next;
+    std::vector<unsigned> m_action_of;
+    std::vector<action> m_actions;
+    std::vector<std::pair<unsigned, unsigned>> m_start_tags;
+    /**
+     * The highest priority thread of each state that accepts, or no_thread.
+     */
+    std::vector<unsigned> m_accept;
+};
+
+/**
+ * Approximate matching: the edit distance from a string to the closest string of a pattern,
+ * up to compile_options::max_errors.
+ *
+ * The pattern is compiled into an exact DFA. A state of the approximate automaton is the fewest
+ * edits with which each state of the exact DFA can be reached, capped at max_errors + 1; reading
+ * a byte follows it, substitutes it or inserts it, and deletions move along the DFA for free
+ * bytes. States are determinized lazily, the first time a transition is taken, so a scan is
+ * linear once the automaton has warmed up. Edits are counted in bytes, also in UTF-8 mode.
+ * RegEx::compile with max_errors set determinizes it in full into a plain DFA.
+ */
+class ApproximateDFA
+{
+public:
+    ApproximateDFA(const char *pattern, const compile_options &options);
+
+    /**
+     * The fewest edits turning the @size bytes starting at @data into a string of the pattern,
+     * or -1 if that takes more than max_errors. Determinizes the states it needs.
+     */
+    int distance(const char *data, std::size_t size);
+
+    /**
+     * The number of states determinized so far.
+     */
+    unsigned num_states() const;
+
+    /**
+     * Determinize every state and return the minimal DFA matching the strings within
+     * max_errors edits.
+     */
+    DFA determinize();
+
+private:
+    typedef std::vector<unsigned char> Errors_t;
+
+    static const unsigned unknown = ~0u;
+    static const unsigned dead = ~1u;
+
+    unsigned next(unsigned state, unsigned char byte);
+
+    unsigned add(Errors_t &&errors);
+
+    /**
+     * Lower @errors along deletions: skipping a byte of the pattern costs one edit.
+     */
+    void close(Errors_t &errors) const;
+
+    DFA m_dfa;
+    unsigned m_limit;
+    /**
+     * The distinct states each DFA state moves to on some byte, the trap excluded.
+     */
+    std::vector<std::vector<unsigned>> m_successors;
+    std::vector<unsigned char> m_representatives;
+
+    std::map<Errors_t, unsigned> m_ids;
+    std::vector<Errors_t> m_states;
+    /**
+     * Indexed by state * number of byte classes + byte class: the next state, dead, or unknown.
+     */
+    std::vector<unsigned> m_table;
+    /**
+     * The distance of each state, -1 if more than max_errors.
+     */
+    std::vector<int> m_distance;
+};
+
+/**
+ * A DFA determinized on demand, whose states are shared by every thread matching with it.
+ *
+ * The pattern becomes a Thompson NFA; a DFA state is a set of its states, built the first time
+ * a match needs it. Nothing ever blocks: a transition slot is filled by compare-and-swap, new
+ * states are interned through an open-addressing hash table of atomic slots, and states live in
+ * chunks that never move. Threads racing to build the same state agree on the one that wins
+ * the slot. At most compile_options::max_states states are built (65536 if 0); past that,
+ * matches go on by simulating the NFA on the uncached part.
+ */
+class LazyDFA
+{
+public:
+    explicit LazyDFA(const char *pattern, const compile_options &options = compile_options());
+
+    ~LazyDFA();
+
+    LazyDFA(const LazyDFA &) = delete;
+    LazyDFA &operator=(const LazyDFA &) = delete;
+
+    /**
+     * Match all @size bytes starting at @data. Safe to call from many threads at once.
+     */
+    bool match(const char *data, std::size_t size) const;
+
+    /**
+     * The number of states built so far.
+     */
+    unsigned num_states() const;
+
+private:
+    typedef std::vector<unsigned> Set_t;
+
+    static const unsigned unknown = ~0u;
+    static const unsigned dead = ~1u;
+    static const unsigned full = ~2u;
+    static const unsigned chunk_size = 1024;
+
+    struct state
+    {
+        Set_t set;
+        bool final;
+        /**
+         * The next state on each byte class, dead, full, or unknown.
+         */
+        std::unique_ptr<std::atomic<unsigned>[]> next;
+    };
+
+    /**
+     * The sorted NFA states reached from @from on @byte, epsilon moves included.
+     */
+    Set_t step(const Set_t &from, unsigned char byte) const;
+
+    void close(Set_t &set) const;
+
+    /**
+     * The id of the state of @set, built if new; dead for the empty set, full when out of room.
+     */
+    unsigned intern(Set_t &&set) const;
+
+    state &at(unsigned id) const;
+
+    struct nfa;
+    std::unique_ptr<nfa> m_nfa;
+    unsigned m_num_classes;
+    std::vector<unsigned char> m_classes;
+    std::vector<unsigned char> m_representatives;
+    unsigned m_start;
+
+    unsigned m_capacity;
+    mutable std::atomic<unsigned> m_count{0};
+    std::unique_ptr<std::atomic<state *>[]> m_chunks;
+    /**
+     * Open addressing, twice m_capacity slots: the id of a state, or unknown.
+     */
+    unsigned m_mask;
+    std::unique_ptr<std::atomic<unsigned>[]> m_slots;
+};
+
+/**
+ * Splits input into tokens of an ordered list of patterns, in one pass.
+ *
+ * The patterns are compiled in parallel with compile_many, then merged into one DFA whose
+ * states are tuples of their states; a state is labelled with the first pattern it accepts.
+ * From each position the scan takes the longest non-empty token, the first pattern winning
+ * ties. Reading past the end of a token is remembered (Reps' tabulation): a (position, state)
+ * pair that led to no longer token is not explored twice, so tokenizing is linear in the
+ * input even when every token overshoots.
+ */
+class Lexer
+{
+public:
+    struct token
+    {
+        unsigned id;
+        std::size_t start;
+        std::size_t end;
+    };
+
+    /**
+     * Token ids are indices into @patterns.
+     */
+    explicit Lexer(const std::vector<std::string> &patterns, const compile_options &options = compile_options());
+
+    /**
+     * Append the tokens of the @size bytes starting at @data to @tokens. Returns where
+     * tokenizing stopped: @size, or the first position at which no token starts.
+     */
+    std::size_t tokenize(const char *data, std::size_t size, std::vector<token> &tokens) const;
+
+    unsigned num_states() const;
+
+private:
+    static const unsigned no_token = ~0u;
+
+    unsigned m_num_classes{0};
+    std::vector<unsigned char> m_classes;
+    /**
+     * Indexed by state * m_num_classes + byte class; the start state is 0 and num_states()
+     * is the trap state.
+     */
+    std::vector<unsigned> m_table;
+    /**
+     * The first pattern each state accepts, or no_token.
+     */
+    std::vector<unsigned> m_accept;
+};
+
+/**
+ * A set of patterns matched in one pass, which can be changed a few patterns at a time.
+ *
+ * Each pattern stays compiled as its own DFA. The combined automaton, whose states are sets
+ * of (pattern, state) pairs, lives in immutable versions: an update builds the next version
+ * from the current one, keeping every state it can still reach and determinizing only the
+ * states that involve the added or removed pattern, then publishes it atomically. Readers
+ * hold on to the version they got for as long as they like.
+ *
+ * The states are determinized when the version is built, not on demand: a pattern that
+ * overlaps most of the set, such as [a-z0-9]+ next to a list of keywords, pairs with nearly
+ * every state, so adding or removing it rebuilds about as many states as the version has.
+ */
+class PatternSet
+{
+public:
+    class Version
+    {
+    public:
+        /**
+         * The ids of the patterns matching all @size bytes starting at @data, in increasing order.
+         */
+        std::vector<unsigned> match(const char *data, std::size_t size) const;
+
+        /**
+         * The number of patterns.
+         */
+        std::size_t size() const;
+
+        unsigned num_states() const;
+
+        /**
+         * How many of the states were determinized for this version rather than carried over.
+         */
+        unsigned built_states() const;
+
+    private:
+        friend class PatternSet;
+
+        typedef std::vector<std::pair<unsigned, unsigned>> State_t;
+
+        std::map<unsigned, std::shared_ptr<const DFA>> m_patterns;
+        /**
+         * The (pattern id, state) pairs of each state, sorted; the start state is 0.
+         */
+        std::vector<State_t> m_states;
+        std::map<State_t, unsigned> m_ids;
+        std::vector<std::vector<unsigned>> m_accepts;
+        unsigned m_num_classes{0};
+        std::vector<unsigned char> m_classes;
+        /**
+         * Indexed by state * m_num_classes + byte class; m_states.size() is the trap state.
+         */
+        std::vector<unsigned> m_table;
+        unsigned m_built_states{0};
+    };
+
+    PatternSet();
+
+    /**
+     * Compile @pattern and publish a version that includes it; return its id.
+     */
+    unsigned add(const char *pattern, const compile_options &options = compile_options());
+
+    /**
+     * Compile @patterns with compile_many and publish one version that includes them all;
+     * return their ids in order.
+     */
+    std::vector<unsigned> add(const std::vector<std::string> &patterns, const compile_options &options = compile_options());
+
+    /**
+     * Publish a version without the pattern @id.
+     */
+    void remove(unsigned id);
+
+    /**
+     * The latest version. Updates do not affect a version once it is returned.
+     */
+    std::shared_ptr<const Version> current() const;
+
+private:
+    void publish(std::map<unsigned, std::shared_ptr<const DFA>> &&patterns);
+
+    std::mutex m_update;
+    unsigned m_next_id{0};
+    std::shared_ptr<const Version> m_current;
+};
 
 } // namespace RegEx
@@ -0,0 +1,283 @@
+/**
+ * Benchmarks for pattern compilation and matching, with std::regex as a baseline.
+ *
+ * Prints one CSV row per (engine, case) to stdout:
+ *   engine,case,pattern,states,compile_us,short_MBps,long_MBps,long_bytes,table_bytes
+ * engine RegEx builds the DFA by subset construction, RegEx-derivatives by Brzozowski derivatives;
+ * RegEx-stride2 also builds the table reading two bytes per lookup (compile_options::stride);
+ * RegEx-compressed matches with the packed table of RegEx::CompressedDFA, RegEx-lazy with
+ * RegEx::LazyDFA, whose states are built during the first runs and whose states column counts them.
+ * states and table_bytes are empty for std::regex; throughput columns are empty when not applicable.
+ * An optional argument restricts the run to cases whose name contains it.
+ */
+
+#include "RegEx.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+typedef std::chrono::steady_clock clock_type;
+
+const std::size_t short_size = 16;
+const std::size_t short_total = 1 << 20;
+const std::size_t long_size = 1 << 20;
+// libstdc++'s std::regex recurses once per input byte and overflows the stack on long inputs
+const std::size_t std_long_size = 1 << 12;
+const double min_seconds = 0.2;
+
+struct bench_case
+{
+    std::string name;
+    std::string pattern;
+    // produce a string of the language of about @size bytes
+    std::function<std::string(std::mt19937 &, std::size_t)> generate;
+    bool fixed_length;
+};
+
+double seconds_since(clock_type::time_point start)
+{
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+/**
+ * Run @f repeatedly for at least min_seconds, return the median seconds per run.
+ */
+template <class F>
+double measure(F f)
+{
+    std::vector<double> samples;
+    auto start = clock_type::now();
+    while (samples.size() < 5 || seconds_since(start) < min_seconds)
+    {
+        auto t = clock_type::now();
+        f();
+        samples.push_back(seconds_since(t));
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+std::string random_string(std::mt19937 &rng, const std::string &alphabet, std::size_t size)
+{
+    std::string s(size, ' ');
+    for (auto &c : s)
+    {
+        c = alphabet[rng() % alphabet.size()];
+    }
+    return s;
+}
+
+std::vector<bench_case> make_cases()
+{
+    std::vector<bench_case> cases;
+
+    {
+        std::string literal = "abcdefghijklmnopqrstuvwxyz";
+        cases.push_back({"literal", literal, [=](std::mt19937 &, std::size_t) { return literal; }, true});
+    }
+
+    for (std::size_t n : {16, 64})
+    {
+        std::mt19937 rng(n);
+        std::vector<std::string> words;
+        std::string pattern = "(";
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            words.push_back(random_string(rng, "abcdefghijklmnopqrstuvwxyz", 3 + rng() % 4));
+            pattern += (i ? "|" : "") + words.back();
+        }
+        pattern += ")*";
+        cases.push_back({"alternation_" + std::to_string(n), pattern, [=](std::mt19937 &rng, std::size_t size) {
+                             std::string s;
+                             while (s.size() < size)
+                             {
+                                 s += words[rng() % words.size()];
+                             }
+                             return s;
+                         },
+                         false});
+    }
+
+    cases.push_back({"nested_stars", "((a*b*)*(c*d*)*)*", [](std::mt19937 &rng, std::size_t size) {
+                         return random_string(rng, "abcd", size);
+                     },
+                     false});
+    cases.push_back({"nested_stars_deep", "((((a*)*b*)*c*)*d*)*", [](std::mt19937 &rng, std::size_t size) {
+                         return random_string(rng, "abcd", size);
+                     },
+                     false});
+
+    for (std::size_t n : {2, 4, 6, 8, 10})
+    {
+        // (a|b)*a(a|b){n}: the DFA needs 2^(n+1) states; written out by hand, then counted
+        std::string expanded = "(a|b)*a";
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            expanded += "(a|b)";
+        }
+        auto generate = [=](std::mt19937 &rng, std::size_t size) {
+            auto s = random_string(rng, "ab", std::max(size, n + 1));
+            s[s.size() - n - 1] = 'a';
+            return s;
+        };
+        cases.push_back({"blowup_" + std::to_string(n), expanded, generate, false});
+        cases.push_back({"blowup_counted_" + std::to_string(n), "(a|b)*a(a|b){" + std::to_string(n) + "}", generate, false});
+    }
+
+    return cases;
+}
+
+std::vector<std::string> short_inputs(const bench_case &c)
+{
+    std::mt19937 rng(42);
+    std::vector<std::string> inputs;
+    std::size_t total = 0;
+    while (total < short_total)
+    {
+        inputs.push_back(c.generate(rng, short_size));
+        total += inputs.back().size();
+    }
+    return inputs;
+}
+
+std::string long_input(const bench_case &c, std::size_t size)
+{
+    std::mt19937 rng(42);
+    return c.generate(rng, size);
+}
+
+template <class Match>
+double throughput(const std::vector<std::string> &inputs, Match match)
+{
+    std::size_t bytes = 0;
+    for (const auto &s : inputs)
+    {
+        bytes += s.size();
+    }
+    bool ok = true;
+    auto seconds = measure([&]() {
+        for (const auto &s : inputs)
+        {
+            ok &= match(s);
+        }
+    });
+    if (!ok)
+    {
+        std::fprintf(stderr, "bench: generated input rejected\n");
+        std::exit(1);
+    }
+    return bytes / seconds / 1e6;
+}
+
+void print_row(const char *engine, const bench_case &c, const std::string &states, double compile_us,
+               double short_MBps, double long_MBps, std::size_t long_bytes, const std::string &table_bytes)
+{
+    std::printf("%s,%s,\"%s\",%s,%.2f,%.2f,", engine, c.name.c_str(), c.pattern.c_str(), states.c_str(), compile_us, short_MBps);
+    if (c.fixed_length)
+    {
+        std::printf(",,");
+    }
+    else
+    {
+        std::printf("%.2f,%zu,", long_MBps, long_bytes);
+    }
+    std::printf("%s\n", table_bytes.c_str());
+    std::fflush(stdout);
+}
+
+void run_regex(const char *engine, const bench_case &c, const RegEx::compile_options &options)
+{
+    auto compile_s = measure([&]() { RegEx::compile(c.pattern.c_str(), options); });
+    const auto dfa = RegEx::compile(c.pattern.c_str(), options);
+    auto match = [&](const std::string &s) { return dfa.match(s.data(), s.size()); };
+
+    auto short_MBps = throughput(short_inputs(c), match);
+    double long_MBps = 0;
+    if (!c.fixed_length)
+    {
+        long_MBps = throughput({long_input(c, long_size)}, match);
+    }
+    print_row(engine, c, std::to_string(dfa.num_states()), compile_s * 1e6, short_MBps, long_MBps, long_size,
+              std::to_string(dfa.table_bytes()));
+}
+
+void run_compressed(const bench_case &c)
+{
+    auto compile_s = measure([&]() { RegEx::CompressedDFA(RegEx::compile(c.pattern.c_str())); });
+    const RegEx::CompressedDFA dfa(RegEx::compile(c.pattern.c_str()));
+    auto match = [&](const std::string &s) { return dfa.match(s.data(), s.size()); };
+
+    auto short_MBps = throughput(short_inputs(c), match);
+    double long_MBps = 0;
+    if (!c.fixed_length)
+    {
+        long_MBps = throughput({long_input(c, long_size)}, match);
+    }
+    print_row("RegEx-compressed", c, std::to_string(dfa.num_states()), compile_s * 1e6, short_MBps, long_MBps, long_size,
+              std::to_string(dfa.table_bytes()));
+}
+
+void run_lazy(const bench_case &c)
+{
+    auto compile_s = measure([&]() { RegEx::LazyDFA(c.pattern.c_str()); });
+    const RegEx::LazyDFA dfa(c.pattern.c_str());
+    auto match = [&](const std::string &s) { return dfa.match(s.data(), s.size()); };
+
+    auto short_MBps = throughput(short_inputs(c), match);
+    double long_MBps = 0;
+    if (!c.fixed_length)
+    {
+        long_MBps = throughput({long_input(c, long_size)}, match);
+    }
+    print_row("RegEx-lazy", c, std::to_string(dfa.num_states()), compile_s * 1e6, short_MBps, long_MBps, long_size, "");
+}
+
+void run_std_regex(const bench_case &c)
+{
+    auto compile_s = measure([&]() { std::regex(c.pattern); });
+    const std::regex re(c.pattern);
+    auto match = [&](const std::string &s) { return std::regex_match(s, re); };
+
+    auto short_MBps = throughput(short_inputs(c), match);
+    double long_MBps = 0;
+    if (!c.fixed_length)
+    {
+        long_MBps = throughput({long_input(c, std_long_size)}, match);
+    }
+    print_row("std::regex", c, "", compile_s * 1e6, short_MBps, long_MBps, std_long_size, "");
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    std::printf("engine,case,pattern,states,compile_us,short_MBps,long_MBps,long_bytes,table_bytes\n");
+    for (const auto &c : make_cases())
+    {
+        if (argc > 1 && c.name.find(argv[1]) == std::string::npos)
+        {
+            continue;
+        }
+        RegEx::compile_options options;
+        run_regex("RegEx", c, options);
+        options.construction = RegEx::Construction::derivatives;
+        run_regex("RegEx-derivatives", c, options);
+        options.construction = RegEx::Construction::subsets;
+        options.stride = 2;
+        run_regex("RegEx-stride2", c, options);
+        run_compressed(c);
+        run_lazy(c);
+        run_std_regex(c);
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+"""
+Generate unicode_tables.hpp, the code point ranges of the Unicode general
+categories supported by \\p{...} in UTF-8 mode and the simple case folding
+orbits used by case-insensitive UTF-8 mode, from Python's unicodedata.
+
+usage: python3 gen_unicode_tables.py > unicode_tables.hpp
+"""
+
+import sys
+import unicodedata
+
+CATEGORIES = ['L', 'N', 'Nd', 'P', 'S', 'Z']
+PER_LINE = 4
+EVEN_ODD = 0
+
+
+def category_ranges(name):
+    '''
+    return the maximal ranges of code points whose general category starts with @name
+    '''
+    ranges = []
+    first = None
+    for cp in range(0x110000):
+        if unicodedata.category(chr(cp)).startswith(name):
+            if first is None:
+                first = cp
+        elif first is not None:
+            ranges.append((first, cp - 1))
+            first = None
+    if first is not None:
+        ranges.append((first, 0x10FFFF))
+    return ranges
+
+
+def simple_fold(c):
+    '''
+    return the simple case folding of @c, or @c if it has none
+    '''
+    folded = c.casefold()
+    if len(folded) != 1:
+        folded = c.lower()
+    return folded if len(folded) == 1 else c
+
+
+def fold_runs():
+    '''
+    return the runs (first, last, delta) mapping each code point to the next one in its
+    case folding orbit, delta being EVEN_ODD for runs of alternating upper and lower case
+    '''
+    orbits = {}
+    for cp in range(0x110000):
+        folded = ord(simple_fold(chr(cp)))
+        if folded != cp:
+            orbit = orbits.get(cp, {cp}) | orbits.get(folded, {folded})
+            for x in orbit:
+                orbits[x] = orbit
+    runs = []
+    for cp in sorted(orbits):
+        orbit = sorted(orbits[cp])
+        delta = orbit[(orbit.index(cp) + 1) % len(orbit)] - cp
+        if runs and runs[-1][1] == cp - 1:
+            run = runs[-1]
+            if run[2] == delta and delta not in (1, -1):
+                run[1] = cp
+                continue
+            if run[2] == EVEN_ODD and delta == (1 if (cp - run[0]) % 2 == 0 else -1):
+                run[1] = cp
+                continue
+            if run[0] == run[1] and run[2] == 1 and delta == -1:
+                run[1] = cp
+                run[2] = EVEN_ODD
+                continue
+        runs.append([cp, cp, delta])
+    return runs
+
+
+def main():
+    # CRLF line endings, like the rest of the tree
+    sys.stdout.reconfigure(newline='\r\n')
+    out = sys.stdout
+    out.write('/**\n')
+    out.write(' * Code point ranges of Unicode general categories and simple case folding orbits, from Unicode %s.\n' % unicodedata.unidata_version)
+    out.write(' * Generated by gen_unicode_tables.py; do not edit.\n')
+    out.write(' */\n\n')
+    out.write('#pragma once\n\n')
+    out.write('namespace RegEx\n{\n\nnamespace unicode\n{\n\n')
+    out.write('struct range\n{\n    unsigned first;\n    unsigned last;\n};\n\n')
+    out.write('struct category\n{\n    const char *name;\n    const range *ranges;\n    unsigned size;\n};\n\n')
+    for name in CATEGORIES:
+        ranges = category_ranges(name)
+        out.write('const range %s[] = {\n' % name)
+        for i in range(0, len(ranges), PER_LINE):
+            line = ', '.join('{0x%X, 0x%X}' % r for r in ranges[i:i + PER_LINE])
+            out.write('    %s,\n' % line)
+        out.write('};\n\n')
+    out.write('const category categories[] = {\n')
+    for name in CATEGORIES:
+        out.write('    {"%s", %s, sizeof(%s) / sizeof(%s[0])},\n' % (name, name, name, name))
+    out.write('};\n\n')
+    out.write('struct fold\n{\n    unsigned first;\n    unsigned last;\n    int delta;\n};\n\n')
+    out.write('// maps code points of alternating case to their neighbour\n')
+    out.write('const int even_odd = %d;\n\n' % EVEN_ODD)
+    out.write('const fold folds[] = {\n')
+    runs = fold_runs()
+    for i in range(0, len(runs), PER_LINE):
+        line = ', '.join('{0x%X, 0x%X, %s}' % (first, last, 'even_odd' if delta == EVEN_ODD else delta)
+                         for first, last, delta in runs[i:i + PER_LINE])
+        out.write('    %s,\n' % line)
+    out.write('};\n\n')
+    out.write('} // namespace unicode\n\n} // namespace RegEx\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,347 @@
+/**
+ * mrgrep: print the lines of the input files that match a regular expression.
+ *
+ * Files are memory-mapped and split into line-aligned chunks, which are matched
+ * against one compiled DFA by a pool of worker threads. Results are printed in
+ * input order. Note that a line is selected only if the whole line matches.
+ */
+
+#include "RegEx.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+const std::size_t chunk_size = 1 << 20;
+
+struct input_file
+{
+    std::string name;
+    const char *data{nullptr};
+    std::size_t size{0};
+    bool mapped{false};
+    std::string buffer; // used when the input cannot be mapped (e.g. stdin)
+};
+
+struct line_ref
+{
+    std::size_t line_no; // relative to the first line of the chunk
+    const char *first;
+    const char *last;
+};
+
+struct chunk
+{
+    const input_file *file;
+    const char *first;
+    const char *last;
+    std::size_t num_lines{0};
+    std::size_t count{0};
+    std::vector<line_ref> lines;
+    bool done{false};
+};
+
+struct options
+{
+    bool count{false};
+    bool invert{false};
+    bool line_numbers{false};
+    unsigned jobs{0};
+    RegEx::compile_options compile;
+};
+
+void usage()
+{
+    std::cerr << "usage: mrgrep [-c] [-v] [-n] [-i] [-u] [-k errors] [-j jobs] pattern [file...]\n"
+              << "  -k errors: 0 to 254, -j jobs: 1 to 1024" << std::endl;
+}
+
+/**
+ * Read @text, all decimal digits, into @value if it lies in [@min, @max].
+ */
+bool parse_number(const char *text, unsigned long min, unsigned long max, unsigned &value)
+{
+    if (*text < '0' || *text > '9')
+    {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long n = std::strtoul(text, &end, 10);
+    if (*end != '\0' || errno == ERANGE || n < min || n > max)
+    {
+        return false;
+    }
+    value = n;
+    return true;
+}
+
+bool map_file(input_file &in)
+{
+    int fd = ::open(in.name.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::perror(in.name.c_str());
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0)
+    {
+        std::perror(in.name.c_str());
+        ::close(fd);
+        return false;
+    }
+    in.size = st.st_size;
+    if (in.size > 0)
+    {
+        void *addr = ::mmap(nullptr, in.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            std::perror(in.name.c_str());
+            ::close(fd);
+            return false;
+        }
+        ::madvise(addr, in.size, MADV_SEQUENTIAL);
+        in.data = static_cast<const char *>(addr);
+        in.mapped = true;
+    }
+    ::close(fd);
+    return true;
+}
+
+void unmap_file(input_file &in)
+{
+    if (in.mapped)
+    {
+        ::munmap(const_cast<char *>(in.data), in.size);
+    }
+}
+
+void split(const input_file &in, std::vector<chunk> &chunks)
+{
+    const char *first = in.data;
+    const char *end = in.data + in.size;
+    while (first != end)
+    {
+        const char *last = first + std::min<std::size_t>(chunk_size, end - first);
+        if (last != end)
+        {
+            auto nl = static_cast<const char *>(std::memchr(last, '\n', end - last));
+            last = nl ? nl + 1 : end;
+        }
+        chunk c;
+        c.file = &in;
+        c.first = first;
+        c.last = last;
+        chunks.push_back(std::move(c));
+        first = last;
+    }
+}
+
+RegEx::DFA compile(const char *pattern, const options &opts)
+{
+    try
+    {
+        return RegEx::compile(pattern, opts.compile);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "mrgrep: invalid pattern: " << e.what() << std::endl;
+        std::exit(2);
+    }
+}
+
+void scan(const RegEx::DFA &dfa, const options &opts, chunk &c)
+{
+    const char *first = c.first;
+    while (first != c.last)
+    {
+        auto nl = static_cast<const char *>(std::memchr(first, '\n', c.last - first));
+        const char *last = nl ? nl : c.last;
+        if (dfa.match(first, last - first) != opts.invert)
+        {
+            ++c.count;
+            if (!opts.count)
+            {
+                c.lines.push_back({c.num_lines, first, last});
+            }
+        }
+        ++c.num_lines;
+        first = nl ? nl + 1 : c.last;
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    options opts;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i)
+    {
+        if (std::strcmp(argv[i], "--") == 0)
+        {
+            ++i;
+            break;
+        }
+        else if (std::strcmp(argv[i], "-c") == 0)
+        {
+            opts.count = true;
+        }
+        else if (std::strcmp(argv[i], "-v") == 0)
+        {
+            opts.invert = true;
+        }
+        else if (std::strcmp(argv[i], "-n") == 0)
+        {
+            opts.line_numbers = true;
+        }
+        else if (std::strcmp(argv[i], "-i") == 0)
+        {
+            opts.compile.case_insensitive = true;
+        }
+        else if (std::strcmp(argv[i], "-u") == 0)
+        {
+            opts.compile.utf8 = true;
+        }
+        else if (std::strcmp(argv[i], "-k") == 0 && i + 1 < argc && parse_number(argv[i + 1], 0, 254, opts.compile.max_errors))
+        {
+            ++i;
+        }
+        else if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc && parse_number(argv[i + 1], 1, 1024, opts.jobs))
+        {
+            ++i;
+        }
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+    if (i >= argc)
+    {
+        usage();
+        return 2;
+    }
+
+    const RegEx::DFA dfa = compile(argv[i++], opts);
+
+    std::vector<input_file> files(i < argc ? argc - i : 1);
+    bool error = false;
+    if (i < argc)
+    {
+        for (auto &in : files)
+        {
+            in.name = argv[i++];
+            error |= !map_file(in);
+        }
+    }
+    else
+    {
+        files[0].name = "(standard input)";
+        files[0].buffer.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+        files[0].data = files[0].buffer.data();
+        files[0].size = files[0].buffer.size();
+    }
+
+    std::vector<chunk> chunks;
+    for (const auto &in : files)
+    {
+        split(in, chunks);
+    }
+
+    unsigned jobs = opts.jobs ? opts.jobs : std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<std::size_t> next(0);
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::thread> workers;
+    for (unsigned j = 0; j < jobs; ++j)
+    {
+        workers.emplace_back([&]() {
+            for (std::size_t k = next++; k < chunks.size(); k = next++)
+            {
+                scan(dfa, opts, chunks[k]);
+                std::lock_guard<std::mutex> lock(mutex);
+                chunks[k].done = true;
+                cv.notify_all();
+            }
+        });
+    }
+
+    // print in input order while the workers move ahead
+    bool prefix = files.size() > 1;
+    std::size_t total = 0;
+    std::size_t k = 0;
+    for (const auto &in : files)
+    {
+        std::size_t line_no = 1;
+        std::size_t count = 0;
+        for (; k < chunks.size() && chunks[k].file == &in; ++k)
+        {
+            auto &c = chunks[k];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return c.done; });
+            }
+            for (const auto &line : c.lines)
+            {
+                if (prefix)
+                {
+                    std::fputs(in.name.c_str(), stdout);
+                    std::fputc(':', stdout);
+                }
+                if (opts.line_numbers)
+                {
+                    std::fprintf(stdout, "%zu:", line_no + line.line_no);
+                }
+                std::fwrite(line.first, 1, line.last - line.first, stdout);
+                std::fputc('\n', stdout);
+            }
+            std::vector<line_ref>().swap(c.lines);
+            line_no += c.num_lines;
+            count += c.count;
+        }
+        if (opts.count)
+        {
+            if (prefix)
+            {
+                std::fprintf(stdout, "%s:", in.name.c_str());
+            }
+            std::fprintf(stdout, "%zu\n", count);
+        }
+        total += count;
+    }
+
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    for (auto &in : files)
+    {
+        unmap_file(in);
+    }
+
+    if (error)
+    {
+        return 2;
+    }
+    return total > 0 ? 0 : 1;
+}
@@ -1,11 +1,43 @@
 
 #include "RegEx.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <bitset>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <new>
 #include <string>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
+
+// counts the calls to operator new, for test_allocations
+static std::atomic<unsigned long> g_allocations{0};
+
+void *operator new(std::size_t size)
+{
+    ++g_allocations;
+    if (void *p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    ++g_allocations;
+    return std::malloc(size ? size : 1);
+}
+
+// kept out of line, or GCC pairs the free() below with the library's operator new and warns
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
 
 void test_basic()
 {
@@ -120,6 +152,37 @@ void test_union()
     assert(dfa8("bbb") == false);
 }
 
+void test_rvalue_operations()
+{
+    auto ab = RegEx::DFA(0, {2}, {{0, 'a', 1}, {1, 'b', 2}});
+    auto ba = RegEx::DFA(0, {2}, {{0, 'b', 1}, {1, 'a', 2}});
+
+    // operations on temporaries consume their rules, and leave lvalues untouched
+    auto abba = RegEx::DFA(ab).concatenation(ba);
+    auto ab_or_ba = RegEx::DFA(ab).alternation(ba);
+    auto ab_star = RegEx::DFA(ab).kleene_star();
+    assert(abba("abba") == true);
+    assert(ab_or_ba("ab") == true && ab_or_ba("ba") == true && ab_or_ba("abba") == false);
+    assert(ab_star("") == true && ab_star("abab") == true && ab_star("aba") == false);
+    assert(ab("ab") == true && ab.rules().size() == 2);
+}
+
+unsigned long allocations_to_compile(const char *regex)
+{
+    RegEx::DFA::from_regex(regex); // warms up the thread's buffers
+    auto before = g_allocations.load();
+    RegEx::DFA::from_regex(regex);
+    return g_allocations.load() - before;
+}
+
+void test_allocations()
+{
+    // the unpooled construction took 428, 7421 and 6639 allocations
+    assert(allocations_to_compile("b(a|b)*b") < 300);
+    assert(allocations_to_compile("(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)") < 1500);
+    assert(allocations_to_compile("abcdefghijklmnopqrstuvwxyz") < 2000);
+}
+
 void test_regex()
 {
     auto dfa = RegEx::DFA::from_regex("b(a|b)*b");
@@ -158,6 +221,1016 @@ void test_regex()
     }
 }
 
+void test_classes()
+{
+    auto ident = RegEx::compile("[a-zA-Z_][a-zA-Z0-9_]*");
+    assert(ident("x") == true);
+    assert(ident("_foo42") == true);
+    assert(ident("42foo") == false);
+    assert(ident("foo-bar") == false);
+    // ranges stay ranges instead of expanding into alternations
+    assert(RegEx::compile("[a-z0-9]").rules().size() == 2);
+    assert(ident.num_classes() == 3);
+
+    auto not_vowel = RegEx::compile("[^aeiou]");
+    assert(not_vowel("b") == true);
+    assert(not_vowel("a") == false);
+    assert(not_vowel("\n") == true);
+
+    // ']' first and '-' last are literals
+    auto brackets = RegEx::compile("[]a-]*");
+    assert(brackets("]-a]") == true);
+    assert(brackets("b") == false);
+
+    auto dot = RegEx::compile("a.c");
+    assert(dot("abc") == true);
+    assert(dot("a.c") == true);
+    assert(dot("a\nc") == false);
+    assert(dot("ac") == false);
+
+    auto escapes = RegEx::compile("\\(\\d\\d\\)\\.\\*\\x41[\\s\\]]");
+    assert(escapes("(42).*A ") == true);
+    assert(escapes("(42).*A]") == true);
+    assert(escapes("(4x).*A ") == false);
+
+    auto words = RegEx::compile("\\w*\\W\\S");
+    assert(words("foo_1 x") == true);
+    assert(words("foo_1  ") == false);
+
+    // postfix '*' after a group, and empty groups in a concatenation
+    assert(RegEx::compile("a*(b)")("aab") == true);
+    assert(RegEx::compile("(a*)b")("aab") == true);
+    assert(RegEx::compile("a()c")("ac") == true);
+
+    for (const char *pattern : {"[a", "[]", "[z-a]", "\\", "\\q", "\\x0", "\\x00", "*a", "(*)"})
+    {
+        bool thrown = false;
+        try
+        {
+            RegEx::compile(pattern);
+        }
+        catch (const RegEx::ParsingException &)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    // the basic syntax only has '(', ')', '|' and '*'
+    RegEx::compile_options basic;
+    basic.basic_syntax = true;
+    auto literals = RegEx::compile("[a.]+?{1}\\d(x|y)*", basic);
+    assert(literals("[a.]+?{1}\\dxy") == true);
+    assert(literals("a") == false);
+    assert(RegEx::compile("\\", basic)("\\") == true);
+    assert(RegEx::compile("a{", basic)("a{") == true);
+}
+
+void test_repetition()
+{
+    auto plus = RegEx::compile("(ab)+c?");
+    assert(plus("") == false);
+    assert(plus("ab") == true);
+    assert(plus("ababc") == true);
+    assert(plus("c") == false);
+
+    auto counted = RegEx::compile("a{2,3}");
+    assert(counted("a") == false);
+    assert(counted("aa") == true);
+    assert(counted("aaa") == true);
+    assert(counted("aaaa") == false);
+
+    auto at_least = RegEx::compile("(a|b){2,}");
+    assert(at_least("a") == false);
+    assert(at_least("ab") == true);
+    assert(at_least("abbab") == true);
+
+    auto optional = RegEx::compile("a{0,2}b");
+    assert(optional("b") == true);
+    assert(optional("aab") == true);
+    assert(optional("aaab") == false);
+
+    assert(RegEx::compile("x{0}")("") == true);
+    assert(RegEx::compile("x{0}")("x") == false);
+    assert(RegEx::compile("x{3}")("xxx") == true);
+
+    // a repetition is determinized once, and its DFA grows linearly with the count
+    RegEx::compile_stats stats;
+    auto length = RegEx::compile("[a-z0-9]{3,50}", &stats);
+    assert(stats.determinizations == 1);
+    assert(length.num_states() == 51);
+    assert(length("abc") == true);
+    assert(length("ab") == false);
+    assert(length(std::string(50, 'z').c_str()) == true);
+    assert(length(std::string(51, 'z').c_str()) == false);
+
+    for (const char *pattern : {"+", "a{", "a{2", "a{,2}", "a{3,2}", "a{1001}", "(?)"})
+    {
+        bool thrown = false;
+        try
+        {
+            RegEx::compile(pattern);
+        }
+        catch (const RegEx::ParsingException &)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+void test_utf8()
+{
+    RegEx::compile_options utf8;
+    utf8.utf8 = true;
+
+    // '.' consumes a whole code point, in byte mode a single byte
+    auto dot = RegEx::compile("a.c", utf8);
+    assert(dot("a\xCE\xB1" "c") == true);
+    assert(dot("a\xF0\x9F\x98\x80" "c") == true);
+    assert(dot("a\xCE" "c") == false);
+    assert(RegEx::compile("a.c")("a\xCE\xB1" "c") == false);
+    assert(RegEx::compile("a..c")("a\xCE\xB1" "c") == true);
+
+    // overlong encodings and surrogates are not code points
+    auto any = RegEx::compile(".", utf8);
+    assert(any("\xC0\x80") == false);
+    assert(any("\xED\xA0\x80") == false);
+    assert(any("\xF4\x90\x80\x80") == false);
+
+    // literals, classes and repetitions apply to code points
+    auto greek = RegEx::compile("[\xCE\xB1-\xCF\x89]+", utf8);
+    assert(greek("\xCE\xB1\xCE\xB2\xCF\x89") == true);
+    assert(greek("\xCE\xB1" "a") == false);
+    assert(RegEx::compile("\xCE\xB1{2}", utf8)("\xCE\xB1\xCE\xB1") == true);
+    assert(RegEx::compile("\\x{3B1}", utf8)("\xCE\xB1") == true);
+    assert(RegEx::compile("[^a]", utf8)("\xE2\x82\xAC") == true);
+
+    auto letters = RegEx::compile("\\p{L}+\\P{L}", utf8);
+    assert(letters("abc\xCE\xB1\xE4\xB8\xAD" "1") == true);
+    assert(letters("ab1c") == false);
+    assert(RegEx::compile("\\pN", utf8)("\xD9\xA3") == true);
+
+    // ASCII-only classes keep to single-byte rules
+    assert(RegEx::compile("[a-z]", utf8).rules().size() == 1);
+
+    for (const char *pattern : {"\xCE", "\xC0\x80", "\x80", "\\p{Foo}", "\\x{D800}", "\\x{110000}"})
+    {
+        bool thrown = false;
+        try
+        {
+            RegEx::compile(pattern, utf8);
+        }
+        catch (const RegEx::ParsingException &)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    for (const char *pattern : {"\\p{L}", "\\x{100}"})
+    {
+        bool thrown = false;
+        try
+        {
+            RegEx::compile(pattern);
+        }
+        catch (const RegEx::ParsingException &)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+void test_case_insensitive()
+{
+    RegEx::compile_options ci;
+    ci.case_insensitive = true;
+
+    auto hello = RegEx::compile("hel+o [a-c]\\w", ci);
+    assert(hello("HeLLo B_") == true);
+    assert(hello("hello cz") == true);
+    assert(hello("hello d1") == false);
+    // cases share transitions instead of doubling the alternations
+    assert(hello.num_states() == RegEx::compile("hel+o [a-c]\\w").num_states());
+    assert(RegEx::compile("a", ci).rules().size() == 2);
+
+    // negation applies after folding
+    auto not_a = RegEx::compile("[^a]", ci);
+    assert(not_a("A") == false);
+    assert(not_a("b") == true);
+
+    // byte mode only folds ASCII
+    assert(RegEx::compile("\xE9", ci)("\xC9") == false);
+
+    ci.utf8 = true;
+    assert(RegEx::compile("\xCF\x83", ci)("\xCE\xA3") == true);            // sigma, capital sigma
+    assert(RegEx::compile("\xCF\x83", ci)("\xCF\x82") == true);            // final sigma
+    assert(RegEx::compile("k", ci)("\xE2\x84\xAA") == true);               // Kelvin sign
+    assert(RegEx::compile("[\xC4\x80-\xC4\x85]+", ci)("\xC4\x81\xC4\x84") == true); // alternating cases
+    assert(RegEx::compile("[^\xC3\xA9]", ci)("\xC3\x89") == false);
+}
+
+void test_boolean_operations()
+{
+    // matches A and not B and not C in one automaton
+    auto a = RegEx::compile("[a-z]+\\d*");
+    auto b = RegEx::compile(".*x.*");
+    auto c = RegEx::compile("[a-z]*0");
+    auto filter = a.difference(b).difference(c);
+    assert(filter("abc1") == true);
+    assert(filter("abc") == true);
+    assert(filter("axc1") == false);
+    assert(filter("abc0") == false);
+    assert(filter("abc10") == true);
+    assert(filter("1abc") == false);
+
+    auto both = a.intersection(RegEx::compile("...."));
+    assert(both("ab12") == true);
+    assert(both("ab1") == false);
+    assert(both("12ab") == false);
+
+    auto not_a = a.complement();
+    assert(not_a("") == true);
+    assert(not_a("abc1") == false);
+    assert(not_a("1abc") == true);
+    assert(not_a.complement().num_states() == a.minimize().num_states());
+
+    // (a|b)*a(a|b) needs 4 states; subset construction leaves an extra one
+    auto blowup = RegEx::compile("(a|b)*a(a|b)");
+    assert(blowup.minimize().num_states() == 4);
+    assert(blowup.minimize()("bbab") == true);
+    assert(blowup.minimize()("bbba") == false);
+
+    assert(a.intersection(not_a).num_states() == 1);
+    assert(a.intersection(not_a)("abc") == false);
+    assert(a.intersection(not_a)("") == false);
+}
+
+void test_derivatives()
+{
+    RegEx::compile_options derivatives;
+    derivatives.construction = RegEx::Construction::derivatives;
+
+    // every string over {a, b, c} up to length 6
+    std::vector<std::string> strings{""};
+    for (std::size_t i = 0; i < strings.size() && strings[i].size() < 6; ++i)
+    {
+        for (char c : {'a', 'b', 'c'})
+        {
+            strings.push_back(strings[i] + c);
+        }
+    }
+
+    for (const char *pattern : {"", "()", "b(a|b)*b", "(1(01*0)*1|0)*", "((a*b*)*(c*d*)*)*", "(a|b)*a(a|b)(a|b)",
+                                "[ab]+c?", "(ab|a)(bc|c)*", "a{2,3}(b|c){0,2}", "(a|())*b", ".{2,}", "(a*)*"})
+    {
+        auto expected = RegEx::compile(pattern);
+        auto dfa = RegEx::compile(pattern, derivatives);
+        assert(dfa.num_states() <= expected.num_states());
+        for (const auto &s : strings)
+        {
+            assert(dfa.match(s.data(), s.size()) == expected.match(s.data(), s.size()));
+        }
+    }
+
+    // ACI-normalized alternation: (a|b)* and (b|a|a)* are the same term, one state
+    assert(RegEx::compile("(b|a|a)*", derivatives).num_states() == 1);
+    assert(RegEx::compile("(a|b)*a(a|b)(a|b)", derivatives).num_states() == 8);
+
+    derivatives.utf8 = true;
+    derivatives.case_insensitive = true;
+    auto sigma = RegEx::compile("\\p{L}\xCF\x83", derivatives);
+    assert(sigma("\xCE\xB1\xCE\xA3") == true);
+    assert(sigma("1\xCE\xA3") == false);
+
+    derivatives = RegEx::compile_options();
+    derivatives.construction = RegEx::Construction::derivatives;
+    derivatives.max_states = 100;
+    bool thrown = false;
+    try
+    {
+        RegEx::compile("(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)", derivatives);
+    }
+    catch (const RegEx::BudgetException &e)
+    {
+        thrown = e.budget() == RegEx::BudgetException::Budget::states;
+    }
+    assert(thrown);
+}
+
+void test_reorder()
+{
+    auto dfa = RegEx::compile("(a|b)*a(a|b)(a|b)");
+    auto bfs = dfa.reorder();
+    assert(bfs.start_state() == 0);
+    assert(bfs.num_states() == dfa.num_states());
+
+    std::vector<unsigned long long> visits;
+    std::string corpus = "bbbbbbbbbbbbbbbbbbbbabb";
+    assert(dfa.profile(corpus.data(), corpus.size(), visits) == true);
+    unsigned long long total = 0;
+    for (auto v : visits)
+    {
+        total += v;
+    }
+    assert(visits.size() == dfa.num_states());
+    assert(total == corpus.size() + 1);
+
+    // the state looping on 'b' is the hottest, so it comes first
+    auto hot = dfa.reorder(visits);
+    std::vector<unsigned long long> hot_visits;
+    hot.profile(corpus.data(), corpus.size(), hot_visits);
+    assert(std::max_element(hot_visits.begin(), hot_visits.end()) == hot_visits.begin());
+
+    for (const char *s : {"", "a", "abb", "bbab", "babaa", "aaaa"})
+    {
+        assert(bfs(s) == dfa(s));
+        assert(hot(s) == dfa(s));
+    }
+}
+
+void test_pattern_set()
+{
+    RegEx::PatternSet set;
+    assert(set.current()->match("a", 1).empty());
+
+    auto number = set.add("[0-9]+");
+    auto word = set.add("[a-z]+");
+    auto hex = set.add("[0-9a-f]+");
+    auto v1 = set.current();
+    assert(v1->size() == 3);
+    assert((v1->match("42", 2) == std::vector<unsigned>{number, hex}));
+    assert((v1->match("beef", 4) == std::vector<unsigned>{word, hex}));
+    assert((v1->match("x1", 2) == std::vector<unsigned>{}));
+
+    // a published version never changes
+    set.remove(hex);
+    auto v2 = set.current();
+    assert((v2->match("42", 2) == std::vector<unsigned>{number}));
+    assert((v1->match("42", 2) == std::vector<unsigned>{number, hex}));
+
+    bool thrown = false;
+    try
+    {
+        set.remove(hex);
+    }
+    catch (const std::out_of_range &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // an update only determinizes the states involving the changed pattern
+    std::vector<unsigned> keywords;
+    for (unsigned i = 0; i < 100; ++i)
+    {
+        keywords.push_back(set.add(("kw" + std::to_string(i) + "x[a-z]*").c_str()));
+    }
+    auto before = set.current();
+    auto foo = set.add("foo[0-9]+");
+    auto after = set.current();
+    assert(after->num_states() > before->num_states());
+    assert(after->built_states() < 10);
+    assert((after->match("foo7", 4) == std::vector<unsigned>{foo}));
+    assert((after->match("kw42xyz", 7) == std::vector<unsigned>{keywords[42]}));
+
+    // an overlapping pattern pairs with every state, but each is determinized at most once
+    auto any = set.add("[a-z0-9]+");
+    auto overlapping = set.current();
+    assert(overlapping->num_states() == after->num_states() + 1);
+    assert(overlapping->built_states() <= overlapping->num_states());
+    assert((overlapping->match("kw42xyz", 7) == std::vector<unsigned>{keywords[42], any}));
+    assert((overlapping->match("foo7", 4) == std::vector<unsigned>{foo, any}));
+    set.remove(any);
+    assert(set.current()->num_states() == after->num_states());
+    assert(set.current()->built_states() <= after->num_states());
+    assert((set.current()->match("kw42xyz", 7) == std::vector<unsigned>{keywords[42]}));
+}
+
+void test_compressed()
+{
+    // a keyword set: a sparse trie whose rows mostly lead to the trap
+    std::vector<std::string> keywords;
+    std::string pattern;
+    unsigned seed = 1;
+    for (unsigned i = 0; i < 200; ++i)
+    {
+        std::string word;
+        for (unsigned j = 0; j < 4 + i % 5; ++j)
+        {
+            seed = seed * 1103515245 + 12345;
+            word += 'a' + (seed >> 16) % 26;
+        }
+        keywords.push_back(word);
+        pattern += (i ? "|" : "") + word;
+    }
+    auto dfa = RegEx::compile(pattern.c_str());
+    RegEx::CompressedDFA compressed(dfa);
+    assert(compressed.num_states() == dfa.num_states());
+    assert(compressed.table_bytes() * 4 <= dfa.table_bytes());
+    for (const auto &word : keywords)
+    {
+        assert(compressed.match(word.data(), word.size()));
+        for (std::size_t n = 0; n < word.size(); ++n)
+        {
+            assert(compressed.match(word.data(), n) == dfa.match(word.data(), n));
+        }
+        auto longer = word + "a";
+        assert(compressed.match(longer.data(), longer.size()) == dfa.match(longer.data(), longer.size()));
+    }
+
+    for (const char *regex : {"(a|b)*a(a|b)(a|b)", "[0-9]+(\\.[0-9]+)?", "((a*b*)*(c*d*)*)*", "x*"})
+    {
+        auto small = RegEx::compile(regex);
+        RegEx::CompressedDFA packed(small);
+        for (const char *s : {"", "a", "abb", "bbab", "babaa", "12.5", "12.", "abcd", "dcba", "xxx", "xy"})
+        {
+            assert(packed.match(s, std::strlen(s)) == small.match(s, std::strlen(s)));
+        }
+    }
+}
+
+void test_captures()
+{
+    typedef RegEx::TaggedDFA::Groups_t Groups_t;
+    auto groups = [](const char *pattern, const char *s) {
+        Groups_t groups;
+        if (!RegEx::TaggedDFA(pattern).match(s, std::strlen(s), groups))
+        {
+            groups.clear();
+        }
+        return groups;
+    };
+
+    assert(groups("abc", "abc") == Groups_t({{0, 3}}));
+    assert(groups("abc", "abd").empty());
+    assert(groups("(a*)(a*)", "aaa") == Groups_t({{0, 3}, {0, 3}, {3, 3}}));
+    assert(groups("(a|ab)(c|bcd)", "abcd") == Groups_t({{0, 4}, {0, 1}, {1, 4}}));
+    assert(groups("(a|b)*", "abb") == Groups_t({{0, 3}, {2, 3}}));
+    assert(groups("(a|b)*", "") == Groups_t({{0, 0}, {-1, -1}}));
+    assert(groups("((a)|b)+", "ab") == Groups_t({{0, 2}, {1, 2}, {0, 1}}));
+    assert(groups("x(y)?z", "xz") == Groups_t({{0, 2}, {-1, -1}}));
+    assert(groups("([0-9]+)-([0-9]+)", "10-200") == Groups_t({{0, 6}, {0, 2}, {3, 6}}));
+    assert(groups("(.*)=(.*)", "a=b=c") == Groups_t({{0, 5}, {0, 3}, {4, 5}}));
+    assert(groups("(a{2,3})(a*)", "aaaaa") == Groups_t({{0, 5}, {0, 3}, {3, 5}}));
+    assert(groups("()", "") == Groups_t({{0, 0}, {0, 0}}));
+
+    // many threads stay alive and the winner is only known at the end
+    RegEx::TaggedDFA ambiguous("(a|b)*(a)(a|b)(a|b)");
+    assert(ambiguous.num_groups() == 4);
+    Groups_t g;
+    assert(ambiguous.match("babaab", 6, g));
+    assert(g == Groups_t({{0, 6}, {2, 3}, {3, 4}, {4, 5}, {5, 6}}));
+    assert(!ambiguous.match("babbab", 6, g));
+
+    // code points in UTF-8 mode; offsets are in bytes
+    RegEx::compile_options options;
+    options.utf8 = true;
+    RegEx::TaggedDFA utf8("(.)(\\p{L}+)", options);
+    const char word[] = "\xCE\xB1\xCE\xB2\xCE\xB3";
+    assert(utf8.match(word, 6, g));
+    assert(g == Groups_t({{0, 6}, {0, 2}, {2, 6}}));
+
+    // acceptance agrees with the DFA
+    for (const char *regex : {"(a|b)*a(a|b)", "((a*b*)*(c*d*)*)*", "(ab|a)(bc|c)?"})
+    {
+        auto dfa = RegEx::compile(regex);
+        RegEx::TaggedDFA tagged(regex);
+        for (const char *s : {"", "a", "ab", "abc", "aab", "bab", "abcd", "dcba", "abbc"})
+        {
+            assert(tagged.match(s, std::strlen(s), g) == dfa.match(s, std::strlen(s)));
+        }
+    }
+}
+
+void test_approximate()
+{
+    RegEx::compile_options options;
+    options.max_errors = 2;
+    RegEx::ApproximateDFA fuzzy("identifier", options);
+    auto distance = [&](const char *s) { return fuzzy.distance(s, std::strlen(s)); };
+    assert(distance("identifier") == 0);
+    assert(distance("identifer") == 1);   // deletion
+    assert(distance("identifiers") == 1); // insertion
+    assert(distance("idantifier") == 1);  // substitution
+    assert(distance("idnetifier") == 2);
+    assert(distance("ident") == -1);
+    assert(distance("") == -1);
+
+    // rejected before the pattern is compiled, so even an invalid one reports the limit
+    options.max_errors = 255;
+    bool thrown = false;
+    try
+    {
+        RegEx::ApproximateDFA("(", options);
+    }
+    catch (const std::invalid_argument &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    options.max_errors = 2;
+
+    // the best of all the strings of the pattern
+    RegEx::ApproximateDFA words("(foo|ba+r)_[0-9]+", options);
+    assert(words.distance("foo_1", 5) == 0);
+    assert(words.distance("baaaaar_42", 10) == 0);
+    assert(words.distance("fo_1", 4) == 1);
+    assert(words.distance("bar42", 5) == 1);
+    assert(words.distance("br_", 3) == 2);
+    assert(words.distance("xyz", 3) == -1);
+
+    // states are determinized once and then reused
+    unsigned warm = words.num_states();
+    assert(words.distance("baaaaar_42", 10) == 0);
+    assert(words.num_states() == warm);
+
+    // compile builds the whole automaton as a DFA
+    auto dfa = RegEx::compile("identifier", options);
+    for (const char *s : {"identifier", "identifer", "idnetifier", "ident", "", "identifierxx", "identifierxxx"})
+    {
+        assert(dfa.match(s, std::strlen(s)) == (distance(s) >= 0));
+    }
+    options.max_errors = 0;
+    assert(RegEx::ApproximateDFA("ab*", options).distance("abbb", 4) == 0);
+    assert(RegEx::ApproximateDFA("ab*", options).distance("abcb", 4) == -1);
+}
+
+void test_lazy()
+{
+    const char *regexes[] = {"(a|b)*a(a|b)(a|b)", "b(a|b)*b", "[0-9]+(\\.[0-9]+)?", "((a*b*)*(c*d*)*)*", "", "(x|y)?"};
+    const char *strings[] = {"", "a", "ab", "abb", "babb", "bab", "12", "1.5", "1.", "abcd", "dcba", "x", "xy"};
+    for (auto regex : regexes)
+    {
+        auto dfa = RegEx::compile(regex);
+        RegEx::LazyDFA lazy(regex);
+        for (auto s : strings)
+        {
+            assert(lazy.match(s, std::strlen(s)) == dfa.match(s, std::strlen(s)));
+        }
+        assert(lazy.num_states() <= dfa.num_states() + 1);
+    }
+
+    // only the states the input visits are built, though the full DFA has 2^21 states
+    RegEx::LazyDFA wide("(a|b)*a(a|b){20}");
+    std::string s(1000, 'b');
+    s[979] = 'a';
+    assert(wide.match(s.data(), s.size()));
+    assert(!wide.match(s.data(), s.size() - 1));
+    assert(wide.num_states() < 100);
+
+    // out of room: the match goes on without caching
+    RegEx::compile_options options;
+    options.max_states = 3;
+    RegEx::LazyDFA small("(a|b)*a(a|b)(a|b)", options);
+    for (auto t : {"aaa", "abab", "bbbb", "babba", "abbbbbbaab"})
+    {
+        assert(small.match(t, std::strlen(t)) == RegEx::compile("(a|b)*a(a|b)(a|b)").match(t, std::strlen(t)));
+    }
+    assert(small.num_states() == 3);
+
+    // a full cache stays full while threads keep missing it
+    RegEx::LazyDFA tiny("(a|b)*a(a|b)(a|b)(a|b)", options);
+    auto tiny_reference = RegEx::compile("(a|b)*a(a|b)(a|b)(a|b)");
+    std::vector<std::thread> missing;
+    std::vector<int> wrong(4);
+    for (unsigned t = 0; t < wrong.size(); ++t)
+    {
+        missing.emplace_back([&, t]() {
+            std::string input;
+            for (unsigned i = 0; i < 20000; ++i)
+            {
+                input.clear();
+                for (unsigned n = i * wrong.size() + t; n; n /= 2)
+                {
+                    input += n % 2 ? 'a' : 'b';
+                }
+                wrong[t] += tiny.match(input.data(), input.size()) != tiny_reference.match(input.data(), input.size());
+            }
+        });
+    }
+    for (auto &thread : missing)
+    {
+        thread.join();
+    }
+    assert(std::count(wrong.begin(), wrong.end(), 0) == 4);
+    assert(tiny.num_states() == 3);
+
+    // threads share one cache, each state built once
+    RegEx::LazyDFA shared("(a|b)*a(a|b)(a|b)(a|b)(a|b)");
+    auto reference = RegEx::compile("(a|b)*a(a|b)(a|b)(a|b)(a|b)");
+    std::vector<std::thread> threads;
+    std::vector<int> failures(4);
+    for (unsigned t = 0; t < failures.size(); ++t)
+    {
+        threads.emplace_back([&, t]() {
+            unsigned seed = t + 1;
+            std::string input;
+            for (unsigned i = 0; i < 2000; ++i)
+            {
+                seed = seed * 1103515245 + 12345;
+                input.assign(1 + (seed >> 16) % 12, 'a');
+                for (auto &c : input)
+                {
+                    seed = seed * 1103515245 + 12345;
+                    c = (seed >> 16) % 2 ? 'a' : 'b';
+                }
+                failures[t] += shared.match(input.data(), input.size()) != reference.match(input.data(), input.size());
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    assert(std::count(failures.begin(), failures.end(), 0) == 4);
+    // here the sets of NFA states are the states of the minimal DFA; a lost race wastes an id
+    auto minimal = reference.minimize().num_states();
+    assert(shared.num_states() >= minimal);
+    assert(shared.num_states() < minimal + 4 * 4);
+}
+
+void test_lexer()
+{
+    RegEx::Lexer lexer({"if", "[a-z]+", "[0-9]+", " +", "==|="});
+    const char text[] = "if iffy == 42";
+    std::vector<RegEx::Lexer::token> tokens;
+    assert(lexer.tokenize(text, sizeof(text) - 1, tokens) == sizeof(text) - 1);
+    // "if" wins its tie with [a-z]+, "iffy" is longer than "if", and "==" longer than "="
+    std::vector<std::vector<std::size_t>> expected{{0, 0, 2}, {3, 2, 3}, {1, 3, 7}, {3, 7, 8}, {4, 8, 10}, {3, 10, 11}, {2, 11, 13}};
+    assert(tokens.size() == expected.size());
+    for (std::size_t i = 0; i < tokens.size(); ++i)
+    {
+        assert(tokens[i].id == expected[i][0] && tokens[i].start == expected[i][1] && tokens[i].end == expected[i][2]);
+    }
+
+    // stops where no token starts, keeping the tokens before
+    tokens.clear();
+    assert(lexer.tokenize("ab+1", 4, tokens) == 2);
+    assert(tokens.size() == 1 && tokens[0].id == 1);
+
+    // a token never matches the empty string
+    RegEx::Lexer empty({"a*"});
+    tokens.clear();
+    assert(empty.tokenize("b", 1, tokens) == 0);
+    assert(tokens.empty());
+
+    // every token reads to the end of the input before settling for "a": linear with the memo,
+    // quadratic without
+    RegEx::Lexer overshoot({"a", "a*b"});
+    std::string as(200000, 'a');
+    tokens.clear();
+    assert(overshoot.tokenize(as.data(), as.size(), tokens) == as.size());
+    assert(tokens.size() == as.size() && tokens.back().start == as.size() - 1);
+    as += 'b';
+    tokens.clear();
+    assert(overshoot.tokenize(as.data(), as.size(), tokens) == as.size());
+    assert(tokens.size() == 1 && tokens[0].id == 1);
+}
+
+void test_compile_many()
+{
+    std::vector<std::string> patterns;
+    for (unsigned i = 0; i < 200; ++i)
+    {
+        // every pattern twice
+        patterns.push_back("(a|b)*a" + std::string(i % 100 % 7, 'b') + "[0-9]{" + std::to_string(i % 100 % 5) + "}");
+    }
+    const char *strings[] = {"a", "ab", "abbb1", "bab12", "abbbbbb", "abbbbbb1234", "ba"};
+    for (unsigned threads : {1, 3, 0})
+    {
+        auto dfas = RegEx::compile_many(patterns, RegEx::compile_options(), threads);
+        assert(dfas.size() == patterns.size());
+        for (std::size_t i = 0; i < patterns.size(); i += 37)
+        {
+            auto dfa = RegEx::compile(patterns[i].c_str());
+            assert(dfas[i].num_states() == dfa.num_states());
+            for (auto s : strings)
+            {
+                assert(dfas[i](s) == dfa(s));
+            }
+        }
+    }
+    assert(RegEx::compile_many({}).empty());
+
+    // the first failure is reported once all are compiled
+    bool thrown = false;
+    try
+    {
+        RegEx::compile_many({"a", "(b", "c)", "d"});
+    }
+    catch (const RegEx::ParsingException &e)
+    {
+        thrown = std::string(e.what()) == "missing right parenthesis ')'";
+    }
+    assert(thrown);
+
+    RegEx::PatternSet set;
+    auto ids = set.add(std::vector<std::string>{"[0-9]+", "[a-z]+", "[0-9]+"});
+    assert(ids.size() == 3 && set.current()->size() == 3);
+    assert(set.current()->match("42", 2) == std::vector<unsigned>({ids[0], ids[2]}));
+}
+
+void test_dead_absorbing()
+{
+    auto dfa = RegEx::compile("ab(.|\\n)*").minimize();
+    assert(dfa.is_dead(dfa.num_states()));
+    unsigned absorbing = 0;
+    for (unsigned q = 0; q < dfa.num_states(); ++q)
+    {
+        absorbing += dfa.is_absorbing(q);
+    }
+    assert(absorbing == 1);
+    assert(dfa.match("abxyz", 5));
+    assert(!dfa.match("ab\0c", 4));
+    assert(dfa.is_match_prefix("a", 1));
+    assert(dfa.is_match_prefix("abc", 3));
+    assert(!dfa.is_match_prefix("ax", 2));
+    assert(!dfa.is_match_prefix("ab\0", 3));
+    assert(dfa.earliest_match("abxyz", 5) == 2);
+    assert(dfa.earliest_match("a", 1) == -1);
+    assert(dfa.earliest_match("xab", 3) == -1);
+    assert(RegEx::compile("a*").earliest_match("b", 1) == 0);
+
+    // the early exits agree with reading every byte
+    unsigned seed = 7;
+    for (const char *regex : {"ab(.|\\n)*", "(a|b)*abb", "a(b|c)*", "(ab)*|c(.|\\n)*", "x*"})
+    {
+        for (unsigned stride : {1, 2})
+        {
+            RegEx::compile_options options;
+            options.stride = stride;
+            auto dfa = RegEx::compile(regex, options);
+            RegEx::CompressedDFA reference(dfa);
+            for (unsigned n = 0; n < 500; ++n)
+            {
+                std::string s;
+                for (unsigned i = 0; i < n % 9; ++i)
+                {
+                    seed = seed * 1103515245 + 12345;
+                    s += "abcx\0"[(seed >> 16) % 5];
+                }
+                assert(dfa.match(s.data(), s.size()) == reference.match(s.data(), s.size()));
+                std::ptrdiff_t earliest = -1;
+                bool prefix = false;
+                for (std::size_t k = 0; k <= s.size(); ++k)
+                {
+                    if (reference.match(s.data(), k) && earliest < 0)
+                    {
+                        earliest = k;
+                    }
+                }
+                for (const char *tail : {"", "a", "b", "c", "bb", "abb"})
+                {
+                    auto t = s + tail;
+                    prefix |= reference.match(t.data(), t.size());
+                }
+                assert(dfa.earliest_match(s.data(), s.size()) == earliest);
+                // a prefix with one of the tails is one; the converse holds for these patterns
+                assert(dfa.is_match_prefix(s.data(), s.size()) == prefix);
+            }
+        }
+    }
+}
+
+void test_shuffle()
+{
+    const char *patterns[] = {"a(b|c)*", "[0-9]+", "x?y", "(ab)*", "", "a|b|c", "(a|b)*abb", "[a-z]+[0-9]",
+                              "c*", "ba(a|b)", "x*yx*", "(a|b)(a|b)(a|b)", "abc", "[^a]*", "a+b+", "(a|b)*a(a|b)(a|b)",
+                              "y", ".", "b*a*b*", "0(0|1)*1", "(aa|bb)+", "c+a?", "(a|b)*a(a|b){2}", "z?"};
+    std::vector<RegEx::DFA> dfas;
+    for (auto pattern : patterns)
+    {
+        dfas.push_back(RegEx::compile(pattern));
+    }
+    RegEx::ShuffleDFA shuffle(dfas);
+    assert(shuffle.size() == dfas.size());
+    assert(shuffle.num_banks() > 2);
+
+    unsigned seed = 11;
+    for (unsigned n = 0; n < 2000; ++n)
+    {
+        std::string s;
+        for (unsigned i = 0; i < n % 12 + n / 1000 * 100; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            s += "abcxyz01\n"[(seed >> 16) % (n % 5 ? 3 : 9)];
+        }
+        std::vector<unsigned> expected;
+        for (unsigned i = 0; i < dfas.size(); ++i)
+        {
+            if (dfas[i].match(s.data(), s.size()))
+            {
+                expected.push_back(i);
+            }
+        }
+        assert(shuffle.match(s.data(), s.size()) == expected);
+    }
+    assert(RegEx::ShuffleDFA({}).match("a", 1).empty());
+
+    // too many states even once minimized
+    bool thrown = false;
+    try
+    {
+        RegEx::ShuffleDFA({RegEx::compile("abcdefghijklmnop")});
+    }
+    catch (const std::invalid_argument &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void test_match_buffer()
+{
+    const auto dfa = RegEx::compile("b(a|b)*b");
+    const char text[] = "bab\nbb\nba";
+    assert(dfa.match(text, 3) == true);
+    assert(dfa.match(text + 4, 2) == true);
+    assert(dfa.match(text + 7, 2) == false);
+    assert(dfa.match(text, sizeof(text) - 1) == false);
+    assert(dfa.match(text, 0) == false);
+}
+
+void test_state_width()
+{
+    // a chain of n states reading 'a', plus the trap
+    auto chain = [](unsigned n) {
+        RegEx::DFA::Rules_t R;
+        for (unsigned p = 0; p + 1 < n; ++p)
+        {
+            R.push_back({p, 'a', p + 1});
+        }
+        return RegEx::DFA(0, {n - 1}, R);
+    };
+    struct
+    {
+        unsigned states;
+        unsigned bytes;
+    } widths[] = {{2, 1}, {255, 1}, {256, 2}, {65535, 2}, {65536, 4}, {70000, 4}};
+    for (const auto &w : widths)
+    {
+        auto dfa = chain(w.states);
+        assert(dfa.num_states() == w.states);
+        assert(dfa.state_bytes() == w.bytes);
+        assert(dfa.table_bytes() == (w.states + 1) * dfa.num_classes() * w.bytes + 256);
+        std::string s(w.states - 1, 'a');
+        assert(dfa.match(s.data(), s.size()) == true);
+        assert(dfa.match(s.data(), s.size() - 1) == false);
+        assert(dfa(s.c_str()) == true);
+        assert(dfa.next_state(w.states - 1, 'a') == w.states);
+    }
+    assert(RegEx::compile("(a|b)*a(a|b)(a|b)").state_bytes() == 1);
+}
+
+void test_stride()
+{
+    RegEx::compile_options options;
+    options.stride = 2;
+    for (const char *regex : {"b(a|b)*b", "(a|b)*a(a|b)(a|b)", "[0-9]+(\\.[0-9]+)?", "x*", "abc"})
+    {
+        auto single = RegEx::compile(regex);
+        auto paired = RegEx::compile(regex, options);
+        assert(single.stride() == 1);
+        assert(paired.stride() == 2);
+        assert(paired.table_bytes() > single.table_bytes());
+        // odd and even lengths, so that the last byte is read by either table
+        for (const char *s : {"", "b", "bb", "bab", "baab", "aab", "abab", "12", "1.5", "12.50", "x", "xx", "xxx", "abc", "abcd"})
+        {
+            assert(paired.match(s, std::strlen(s)) == single.match(s, std::strlen(s)));
+            assert(paired(s) == single(s));
+        }
+    }
+
+    // not built when too big
+    options.max_stride_bytes = 64;
+    assert(RegEx::compile("(a|b)*a(a|b)(a|b)", options).stride() == 1);
+    options.construction = RegEx::Construction::derivatives;
+    options.max_stride_bytes = 1 << 20;
+    assert(RegEx::compile("(a|b)*a(a|b)(a|b)", options).stride() == 2);
+}
+
+void test_compile_stats()
+{
+    RegEx::compile_stats stats;
+    auto dfa = RegEx::compile("b(a|b)*b", &stats);
+    assert(dfa("bab") == true);
+    assert(stats.dfa_states == dfa.num_states());
+    assert(stats.dfa_rules == dfa.rules().size());
+    // one determinization per operator: |, *, and two concatenations
+    assert(stats.determinizations == 4);
+    assert(stats.nfa_rules > stats.dfa_rules);
+    assert(stats.subset_iterations >= stats.determinizations);
+    assert(stats.closure_calls > stats.subset_iterations);
+    assert(stats.peak_set_bytes > 0);
+    assert(stats.parse_seconds >= 0 && stats.construct_seconds >= 0);
+    assert(stats.determinize_seconds > 0 && stats.table_seconds > 0);
+
+    // stats are reset on every call
+    RegEx::compile("a", &stats);
+    assert(stats.determinizations == 0);
+    assert(stats.dfa_states == 2);
+    assert(stats.minimized_states == 0);
+
+    // the counts before and after minimization
+    RegEx::compile_options options;
+    options.minimize = true;
+    auto minimal = RegEx::compile("(a|b)*abb|b*abb", options, &stats);
+    assert(minimal.num_states() == 4);
+    assert(stats.minimized_states == minimal.num_states());
+    assert(stats.dfa_states > stats.minimized_states);
+    assert(stats.dfa_states == RegEx::compile("(a|b)*abb|b*abb").num_states());
+    assert(stats.minimize_seconds > 0);
+    assert(minimal("babb") && !minimal("abab"));
+}
+
+void test_shared_subexpressions()
+{
+    // the second (a|b|c) and its parts are copied, not rebuilt: 2 determinizations for the
+    // first one and 2 for the concatenations, instead of 6
+    RegEx::compile_stats stats;
+    auto dfa = RegEx::compile("(a|b|c)x(a|b|c)", &stats);
+    assert(stats.determinizations == 4);
+    assert(stats.shared_subexpressions == 5);
+    assert(dfa("axc") == true);
+    assert(dfa("axd") == false);
+
+    // alternation is commutative, so (b|a) is (a|b)
+    RegEx::compile("(a|b)(b|a)", &stats);
+    assert(stats.determinizations == 2);
+
+    RegEx::compile("(a|b)(a|c)", &stats);
+    assert(stats.determinizations == 3);
+}
+
+void test_budgets()
+{
+    // (a|b)*a(a|b){8} needs 512 DFA states
+    const char *blowup = "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)";
+
+    RegEx::compile_options options;
+    options.max_states = 1000;
+    assert(RegEx::compile(blowup, options).num_states() == 513);
+
+    options.max_states = 100;
+    bool thrown = false;
+    try
+    {
+        RegEx::compile(blowup, options);
+    }
+    catch (const RegEx::BudgetException &e)
+    {
+        thrown = e.budget() == RegEx::BudgetException::Budget::states;
+    }
+    assert(thrown);
+
+    options = RegEx::compile_options();
+    options.max_memory = 64 * 1024;
+    thrown = false;
+    try
+    {
+        RegEx::compile(blowup, options);
+    }
+    catch (const RegEx::BudgetException &e)
+    {
+        thrown = e.budget() == RegEx::BudgetException::Budget::memory;
+    }
+    assert(thrown);
+
+    options = RegEx::compile_options();
+    options.max_seconds = 1e-9;
+    thrown = false;
+    try
+    {
+        RegEx::compile(blowup, options);
+    }
+    catch (const RegEx::BudgetException &e)
+    {
+        thrown = e.budget() == RegEx::BudgetException::Budget::time;
+    }
+    assert(thrown);
+
+    // a failed compilation leaves nothing behind
+    RegEx::compile_stats stats;
+    assert(RegEx::compile("b(a|b)*b", &stats)("bab") == true);
+
+    // malformed patterns are reported rather than aborting
+    for (const char *pattern : {"a(", "a)", "*", "a|", "|a", "(|a)"})
+    {
+        thrown = false;
+        try
+        {
+            RegEx::compile(pattern);
+        }
+        catch (const RegEx::ParsingException &)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
 int main()
 {
     std::cout << "testing basic" << std::endl;
@@ -175,9 +1248,81 @@ int main()
     std::cout << "testing operation union" << std::endl;
     test_union();
 
+    std::cout << "testing operations on temporaries" << std::endl;
+    test_rvalue_operations();
+
+    std::cout << "testing allocations per compile" << std::endl;
+    test_allocations();
+
     std::cout << "testing regular expression to DFA conversion" << std::endl;
     test_regex();
 
+    std::cout << "testing character classes and escapes" << std::endl;
+    test_classes();
+
+    std::cout << "testing repetition operators" << std::endl;
+    test_repetition();
+
+    std::cout << "testing UTF-8 mode" << std::endl;
+    test_utf8();
+
+    std::cout << "testing case-insensitive matching" << std::endl;
+    test_case_insensitive();
+
+    std::cout << "testing intersection, difference and complement" << std::endl;
+    test_boolean_operations();
+
+    std::cout << "testing compilation by derivatives" << std::endl;
+    test_derivatives();
+
+    std::cout << "testing state reordering" << std::endl;
+    test_reorder();
+
+    std::cout << "testing pattern sets" << std::endl;
+    test_pattern_set();
+
+    std::cout << "testing compressed transition tables" << std::endl;
+    test_compressed();
+
+    std::cout << "testing capture groups" << std::endl;
+    test_captures();
+
+    std::cout << "testing approximate matching" << std::endl;
+    test_approximate();
+
+    std::cout << "testing lazy DFA shared by threads" << std::endl;
+    test_lazy();
+
+    std::cout << "testing the lexer" << std::endl;
+    test_lexer();
+
+    std::cout << "testing compilation of many patterns" << std::endl;
+    test_compile_many();
+
+    std::cout << "testing dead and absorbing states" << std::endl;
+    test_dead_absorbing();
+
+    std::cout << "testing shuffled banks of small DFAs" << std::endl;
+    test_shuffle();
+
+    std::cout << "testing matching of non null-terminated buffers" << std::endl;
+    test_match_buffer();
+
+    std::cout << "testing state id widths" << std::endl;
+    test_state_width();
+
+    std::cout << "testing stride-2 tables" << std::endl;
+    test_stride();
+
+    std::cout << "testing compilation statistics" << std::endl;
+    test_compile_stats();
+
+    std::cout << "testing sharing of repeated subexpressions" << std::endl;
+    test_shared_subexpressions();
+
+    std::cout << "testing compilation budgets" << std::endl;
+    test_budgets();
+
     std::cout << "all passed" << std::endl;
 
     return 0;
@@ -179,6 +179,49 @@ void test_extra()
     }
 }
 
+void test_usage()
+{
+    auto &usage = uint_set::usage();
+    auto before = usage.current;
+    {
+        uint_set A{1, 2, 3};
+        assert(usage.current == before + 128);
+        A.add(2000);
+        assert(usage.current == before + 2000 / 8 + 1);
+        assert(usage.peak >= before + 128 + 2000 / 8 + 1);
+    }
+    assert(usage.current == before);
+}
+
+void test_arena()
+{
+    uint_set_arena arena(1024);
+    uint_set outside{7};
+    uint_set copied;
+    {
+        uint_set::arena_scope scope(arena);
+        uint_set A{1, 2, 3};
+        uint_set B(A);
+        B.add(5000);
+        B.rshift(1);
+        assert(B.has(9) && B.has(5008) && !B.has(1));
+        // sets allocated before the scope keep their own storage
+        outside.add(3000);
+        assert(outside.has(7) && outside.has(3000));
+        // freed blocks are recycled
+        for (unsigned n = 0; n < 1000; ++n)
+        {
+            uint_set C{n};
+            assert(C.has(n));
+        }
+        copied = A;
+    }
+    // a set allocated in the arena must be copied out before the arena goes away
+    uint_set detached(copied);
+    copied = uint_set();
+    assert(detached == uint_set({1, 2, 3}));
+}
+
 int main()
 {
     std::cout << "test starts" << std::endl;
@@ -192,6 +235,8 @@ int main()
     test_rshift();
     test_iteration();
     test_extra();
+    test_usage();
+    test_arena();
 
     std::cout << "test completed" << std::endl;
 
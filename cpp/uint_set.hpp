@@ -9,6 +9,7 @@
 #include <cstring>
 #include <initializer_list>
 #include <memory>
+#include <vector>
 
 class uint_set_iterator
 {
@@ -60,9 +61,109 @@ private:
     unsigned m_j;
 };
 
+/**
+ * A pool for uint_set storage.
+ * Blocks are carved out of large chunks and recycled when freed;
+ * the chunks are returned to the system when the arena is destroyed.
+ */
+class uint_set_arena
+{
+public:
+    explicit uint_set_arena(std::size_t chunk_size = 64 * 1024) : m_chunk_size(chunk_size)
+    {
+    }
+
+    ~uint_set_arena()
+    {
+        for (auto chunk : m_chunks)
+        {
+            delete[] chunk;
+        }
+    }
+
+    uint_set_arena(const uint_set_arena &) = delete;
+
+    uint_set_arena &operator=(const uint_set_arena &) = delete;
+
+    unsigned char *allocate(std::size_t size)
+    {
+        auto n = size_class(size);
+        if (n < m_free.size() && m_free[n])
+        {
+            auto block = m_free[n];
+            std::memcpy(&m_free[n], block, sizeof(block));
+            return block;
+        }
+        auto bytes = n * granularity;
+        if (m_left < bytes)
+        {
+            auto chunk_size = std::max(m_chunk_size, bytes);
+            m_chunks.push_back(new unsigned char[chunk_size]);
+            m_next = m_chunks.back();
+            m_left = chunk_size;
+        }
+        auto block = m_next;
+        m_next += bytes;
+        m_left -= bytes;
+        return block;
+    }
+
+    void deallocate(unsigned char *block, std::size_t size)
+    {
+        auto n = size_class(size);
+        if (n >= m_free.size())
+        {
+            m_free.resize(n + 1, nullptr);
+        }
+        std::memcpy(block, &m_free[n], sizeof(block));
+        m_free[n] = block;
+    }
+
+private:
+    static const std::size_t granularity = 64;
+
+    static std::size_t size_class(std::size_t size)
+    {
+        return (size + granularity - 1) / granularity;
+    }
+
+    std::size_t m_chunk_size;
+    std::vector<unsigned char *> m_chunks;
+    unsigned char *m_next{nullptr};
+    std::size_t m_left{0};
+    // free blocks of each size class, linked through their first bytes
+    std::vector<unsigned char *> m_free;
+};
+
 class uint_set
 {
 public:
+    /**
+     * Make the uint_sets allocated by this thread use @arena for the lifetime of the scope.
+     * Sets keep using the arena they were allocated from, so any set that outlives the arena
+     * must be copied after the scope ends.
+     */
+    class arena_scope
+    {
+    public:
+        explicit arena_scope(uint_set_arena &arena) : m_previous(current_arena())
+        {
+            current_arena() = &arena;
+        }
+
+        ~arena_scope()
+        {
+            current_arena() = m_previous;
+        }
+
+        arena_scope(const arena_scope &) = delete;
+
+        arena_scope &operator=(const arena_scope &) = delete;
+
+    private:
+        uint_set_arena *m_previous;
+    };
+
     uint_set()
     {
         allocate(128); // sufficient for integers in range [0, 1024)
@@ -106,6 +207,23 @@ public:
         return *this;
     }
 
+    /**
+     * Bytes held by the uint_sets of the calling thread, and the highest value it has reached.
+     * A set freed by a thread other than the one that allocated it makes both threads drift,
+     * so only differences taken on one thread are meaningful.
+     */
+    struct usage_stats
+    {
+        long long current;
+        long long peak;
+    };
+
+    static usage_stats &usage()
+    {
+        static thread_local usage_stats stats{0, 0};
+        return stats;
+    }
+
     /**
      * Read-only iterators
      */
@@ -147,12 +265,14 @@ public:
     void rshift(unsigned int n)
     {
         auto new_size = m_bytes_size + n;
-        auto temp = new unsigned char[new_size];
+        auto arena = current_arena();
+        auto temp = acquire(arena, new_size);
         std::memset(temp, 0, n);
         std::memcpy(temp + n, m_bytes, m_bytes_size);
         deallocate();
         m_bytes = temp;
         m_bytes_size = new_size;
+        m_arena = arena;
     }
 
     /**
@@ -334,11 +454,24 @@ private:
         return false;
     }
 
+    static uint_set_arena *&current_arena()
+    {
+        static thread_local uint_set_arena *arena = nullptr;
+        return arena;
+    }
+
+    static unsigned char *acquire(uint_set_arena *arena, unsigned int size)
+    {
+        account(size);
+        return arena ? arena->allocate(size) : new unsigned char[size];
+    }
+
     void allocate(unsigned int size)
     {
         if (m_bytes_size < size)
         {
-            auto temp_bytes = new unsigned char[size];
+            auto arena = current_arena();
+            auto temp_bytes = acquire(arena, size);
             if (m_bytes_size > 0)
             {
                 std::memcpy(temp_bytes, m_bytes, m_bytes_size);
@@ -347,6 +480,7 @@ private:
             deallocate();
             m_bytes_size = size;
             m_bytes = temp_bytes;
+            m_arena = arena;
         }
     }
 
@@ -354,9 +488,28 @@ private:
     {
         if (m_bytes_size > 0 && m_bytes)
         {
-            delete[] m_bytes;
+            if (m_arena)
+            {
+                m_arena->deallocate(m_bytes, m_bytes_size);
+            }
+            else
+            {
+                delete[] m_bytes;
+            }
+            account(-static_cast<long long>(m_bytes_size));
             m_bytes = nullptr;
             m_bytes_size = 0;
+            m_arena = nullptr;
+        }
+    }
+
+    static void account(long long bytes)
+    {
+        auto &stats = usage();
+        stats.current += bytes;
+        if (stats.current > stats.peak)
+        {
+            stats.peak = stats.current;
         }
     }
 
@@ -364,8 +517,11 @@ private:
     {
         std::swap(m_bytes, other.m_bytes);
         std::swap(m_bytes_size, other.m_bytes_size);
+        std::swap(m_arena, other.m_arena);
     }
 
     unsigned int m_bytes_size{0};
     unsigned char *m_bytes{nullptr};
+    // where m_bytes came from, or nullptr for the heap
+    uint_set_arena *m_arena{nullptr};
 };
@@ -1,4 +1,11 @@
 
+try:
+    # the C++ engine, when built (see setup.py). It reads the full C++ syntax by default; with
+    # basic=True it reads the syntax below, where only '(', ')', '|' and '*' are operators.
+    import _RegEx as native
+except ImportError:
+    native = None
+
 
 def match(pattern, string):
     dfa = compile(pattern)
@@ -6,6 +13,15 @@ def match(pattern, string):
 
 
 def compile(pattern):
+    '''
+    compile @pattern with the native module if it is built, else with DFA.from_regex
+    '''
+    if native is not None and isinstance(pattern, (str, bytes)):
+        try:
+            return native.compile(pattern, basic=True)
+        except ValueError:
+            # a pattern the native parser rejects gets the error (or the reading) of DFA.from_regex
+            pass
     return DFA.from_regex(pattern)
 
 
@@ -39,6 +55,9 @@ class DFA:
                 q_int = len(states)
                 states.append(q)
             self.Rs.append((p_int, a, q_int))
+        if S not in states:
+            # no rules, e.g. the star of the empty string
+            states.append(S)
         self.S = states.index(S)
         self.Fs = set([states.index(s) for s in Fs])
 
@@ -192,11 +211,13 @@ class DFA:
         for a in regex:
             if a == '(':
                 if is_last_tk_dfa:
+                    while op_s and op_s[-1] in ('*', ):
+                        DFA._eval(op_s.pop(), dfa_s)
                     op_s.append('+')
                 op_s.append(a)
                 is_last_tk_dfa = False
             elif a == ')':
-                if op_s and op_s[-1] == '(':
+                if not is_last_tk_dfa and op_s and op_s[-1] == '(':
                     dfa_s.append(e)
                 while op_s and op_s[-1] != '(':
                     DFA._eval(op_s.pop(), dfa_s)
@@ -204,6 +225,7 @@ class DFA:
                     op_s.pop()
                 else:
                     raise Exception("missing left parenthesis '('")
+                is_last_tk_dfa = True
             elif a == '|':
                 while op_s and op_s[-1] in ('*', '+', ):
                     DFA._eval(op_s.pop(), dfa_s)
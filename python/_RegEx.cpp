@@ -0,0 +1,302 @@
+/**
+ * _RegEx: the C++ engine as a CPython extension module.
+ *
+ * RegEx.py exposes it as RegEx.native when it is built; patterns have the C++ syntax, or with
+ * basic=True the basic syntax of RegEx.py, which RegEx.compile and RegEx.match use. str
+ * patterns are compiled in UTF-8 mode and str inputs are matched as their UTF-8 encoding;
+ * bytes patterns are compiled byte by byte. Inputs can be any contiguous buffer (bytes,
+ * bytearray, memoryview, mmap, ...), which is matched in place. The GIL is released while
+ * compiling and matching.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "RegEx.h"
+
+#include <cstring>
+#include <exception>
+#include <new>
+
+namespace
+{
+
+struct DFAObject
+{
+    PyObject_HEAD
+    RegEx::DFA *dfa;
+};
+
+PyTypeObject *DFA_type = nullptr;
+
+/**
+ * Set the Python exception for the C++ exception being handled.
+ */
+void set_error()
+{
+    try
+    {
+        throw;
+    }
+    catch (const RegEx::ParsingException &e)
+    {
+        PyErr_SetString(PyExc_ValueError, e.what());
+    }
+    catch (const RegEx::BudgetException &e)
+    {
+        PyErr_SetString(PyExc_MemoryError, e.what());
+    }
+    catch (const std::bad_alloc &)
+    {
+        PyErr_NoMemory();
+    }
+    catch (const std::exception &e)
+    {
+        PyErr_SetString(PyExc_RuntimeError, e.what());
+    }
+}
+
+RegEx::DFA *compile_pattern(PyObject *pattern, bool basic)
+{
+    RegEx::compile_options options;
+    options.basic_syntax = basic;
+    const char *regex = nullptr;
+    Py_ssize_t size = 0;
+    if (PyUnicode_Check(pattern))
+    {
+        options.utf8 = true;
+        regex = PyUnicode_AsUTF8AndSize(pattern, &size);
+        if (!regex)
+        {
+            return nullptr;
+        }
+    }
+    else if (PyBytes_Check(pattern))
+    {
+        regex = PyBytes_AS_STRING(pattern);
+        size = PyBytes_GET_SIZE(pattern);
+    }
+    else
+    {
+        PyErr_SetString(PyExc_TypeError, "pattern must be str or bytes");
+        return nullptr;
+    }
+    if (std::strlen(regex) != static_cast<std::size_t>(size))
+    {
+        PyErr_SetString(PyExc_ValueError, "pattern contains a null character");
+        return nullptr;
+    }
+
+    RegEx::DFA *dfa = nullptr;
+    std::exception_ptr error;
+    Py_BEGIN_ALLOW_THREADS
+    try
+    {
+        dfa = new RegEx::DFA(RegEx::compile(regex, options));
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    Py_END_ALLOW_THREADS
+    if (error)
+    {
+        // translated with the GIL held
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (...)
+        {
+            set_error();
+        }
+        return nullptr;
+    }
+    return dfa;
+}
+
+/**
+ * Match @data against @dfa: 1 or 0, or -1 with a Python exception set.
+ */
+int match_data(const RegEx::DFA &dfa, PyObject *data)
+{
+    bool matched = false;
+    if (PyUnicode_Check(data))
+    {
+        Py_ssize_t size;
+        const char *utf8 = PyUnicode_AsUTF8AndSize(data, &size);
+        if (!utf8)
+        {
+            return -1;
+        }
+        // the UTF-8 form is cached by the str object, which the caller keeps alive
+        Py_BEGIN_ALLOW_THREADS
+        matched = dfa.match(utf8, size);
+        Py_END_ALLOW_THREADS
+        return matched;
+    }
+
+    Py_buffer view;
+    if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) < 0)
+    {
+        return -1;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    matched = dfa.match(static_cast<const char *>(view.buf), view.len);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    return matched;
+}
+
+void DFA_dealloc(DFAObject *self)
+{
+    delete self->dfa;
+    PyTypeObject *type = Py_TYPE(self);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+PyObject *DFA_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"pattern", "basic", nullptr};
+    PyObject *pattern;
+    int basic = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", const_cast<char **>(keywords), &pattern, &basic))
+    {
+        return nullptr;
+    }
+    RegEx::DFA *dfa = compile_pattern(pattern, basic);
+    if (!dfa)
+    {
+        return nullptr;
+    }
+    auto self = reinterpret_cast<DFAObject *>(type->tp_alloc(type, 0));
+    if (!self)
+    {
+        delete dfa;
+        return nullptr;
+    }
+    self->dfa = dfa;
+    return reinterpret_cast<PyObject *>(self);
+}
+
+PyObject *DFA_match(DFAObject *self, PyObject *data)
+{
+    int matched = match_data(*self->dfa, data);
+    if (matched < 0)
+    {
+        return nullptr;
+    }
+    return PyBool_FromLong(matched);
+}
+
+PyObject *DFA_call(DFAObject *self, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"string", nullptr};
+    PyObject *data;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", const_cast<char **>(keywords), &data))
+    {
+        return nullptr;
+    }
+    return DFA_match(self, data);
+}
+
+PyObject *DFA_num_states(DFAObject *self, void *)
+{
+    return PyLong_FromUnsignedLong(self->dfa->num_states());
+}
+
+PyMethodDef DFA_methods[] = {
+    {"match", reinterpret_cast<PyCFunction>(DFA_match), METH_O,
+     "match(string) -> bool\n\nWhether the whole of string (str or a buffer such as bytes) matches."},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+PyGetSetDef DFA_getset[] = {
+    {const_cast<char *>("num_states"), reinterpret_cast<getter>(DFA_num_states), nullptr,
+     const_cast<char *>("number of states, not counting the trap state"), nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr},
+};
+
+PyType_Slot DFA_slots[] = {
+    {Py_tp_doc, const_cast<char *>("DFA(pattern, basic=False)\n\nA pattern compiled by the C++ engine.")},
+    {Py_tp_new, reinterpret_cast<void *>(DFA_new)},
+    {Py_tp_dealloc, reinterpret_cast<void *>(DFA_dealloc)},
+    {Py_tp_call, reinterpret_cast<void *>(DFA_call)},
+    {Py_tp_methods, DFA_methods},
+    {Py_tp_getset, DFA_getset},
+    {0, nullptr},
+};
+
+PyType_Spec DFA_spec = {
+    "_RegEx.DFA",
+    sizeof(DFAObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    DFA_slots,
+};
+
+PyObject *module_compile(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    return PyObject_Call(reinterpret_cast<PyObject *>(DFA_type), args, kwargs);
+}
+
+PyObject *module_match(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"pattern", "string", "basic", nullptr};
+    PyObject *pattern;
+    PyObject *data;
+    int basic = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|p", const_cast<char **>(keywords), &pattern, &data, &basic))
+    {
+        return nullptr;
+    }
+    RegEx::DFA *dfa = compile_pattern(pattern, basic);
+    if (!dfa)
+    {
+        return nullptr;
+    }
+    int matched = match_data(*dfa, data);
+    delete dfa;
+    if (matched < 0)
+    {
+        return nullptr;
+    }
+    return PyBool_FromLong(matched);
+}
+
+PyMethodDef module_methods[] = {
+    {"compile", reinterpret_cast<PyCFunction>(module_compile), METH_VARARGS | METH_KEYWORDS,
+     "compile(pattern, basic=False) -> DFA\n\nWith basic=True, only '(', ')', '|' and '*' are operators."},
+    {"match", reinterpret_cast<PyCFunction>(module_match), METH_VARARGS | METH_KEYWORDS,
+     "match(pattern, string, basic=False) -> bool"},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    "_RegEx",
+    "The C++ regular expression engine.",
+    -1,
+    module_methods,
+};
+
+} // namespace
+
+PyMODINIT_FUNC PyInit__RegEx()
+{
+    PyObject *module = PyModule_Create(&module_def);
+    if (!module)
+    {
+        return nullptr;
+    }
+    DFA_type = reinterpret_cast<PyTypeObject *>(PyType_FromSpec(&DFA_spec));
+    if (!DFA_type || PyModule_AddObject(module, "DFA", reinterpret_cast<PyObject *>(DFA_type)) < 0)
+    {
+        Py_XDECREF(DFA_type);
+        Py_DECREF(module);
+        return nullptr;
+    }
+    Py_INCREF(DFA_type);
+    return module;
+}
@@ -0,0 +1,21 @@
+"""
+Build the _RegEx extension module, the C++ engine for RegEx.py:
+
+    python3 setup.py build_ext --inplace
+"""
+
+from setuptools import Extension, setup
+
+setup(
+    name='RegEx',
+    py_modules=['RegEx'],
+    ext_modules=[
+        Extension(
+            '_RegEx',
+            sources=['_RegEx.cpp', '../cpp/RegEx.cpp'],
+            include_dirs=['../cpp'],
+            extra_compile_args=['-std=c++11'],
+            language='c++',
+        ),
+    ],
+)
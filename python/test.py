@@ -149,6 +149,85 @@ def test_regex():
         assert(div3(bin(i)[2:]) == (i % 3 == 0))
 
 
+def test_native():
+    dfa = RegEx.native.compile("a(a|b|c)*b")
+    assert (dfa("abacabb") == True)
+    assert (dfa.match("abaca") == False)
+    # buffers are matched in place
+    assert (dfa(b"abcb") == True)
+    assert (dfa(bytearray(b"abcb")) == True)
+    assert (dfa(memoryview(b"xabcbx")[1:5]) == True)
+    assert (dfa.num_states > 0)
+
+    # str patterns are read as UTF-8, so '.' is one character
+    assert (RegEx.native.match("a.c", "a\u03b1c") == True)
+    assert (RegEx.native.match(b"a.c", "a\u03b1c".encode()) == False)
+    assert (RegEx.native.match(b"a..c", "a\u03b1c".encode()) == True)
+
+    try:
+        RegEx.native.compile("(a")
+        assert (False)
+    except ValueError:
+        pass
+    try:
+        dfa(42)
+        assert (False)
+    except TypeError:
+        pass
+
+
+def test_paths():
+    # compile and match read a pattern the same way with the native module as with DFA.from_regex
+    cases = [
+        ("a.c", "abc", False),
+        ("a.c", "a.c", True),
+        ("a+", "aa", False),
+        ("a+", "a+", True),
+        ("a?", "a?", True),
+        ("[ab]", "[ab]", True),
+        ("a{2}", "a{2}", True),
+        ("a\\b", "a\\b", True),
+        ("b(a|b)*b", "bab", True),
+        ("(1(01*0)*1|0)*", "110", True),
+        ("a|b.c*", "b.ccc", True),
+        # groups are operands like any other
+        ("(a)b", "ab", True),
+        ("a*(b)", "aab", True),
+        ("()a", "a", True),
+        ("()*", "", True),
+        ("(a|)", "", True),
+    ]
+    native = RegEx.native
+    try:
+        for module in (native, None):
+            RegEx.native = module
+            for pattern, string, expected in cases[:-1]:
+                test_match(pattern, string, expected)
+                assert (RegEx.compile(pattern)(string) == expected)
+            for pattern in ("(a", "(a|)"):
+                error = None
+                try:
+                    RegEx.compile(pattern)
+                except Exception as e:
+                    error = e
+                assert (type(error) is Exception)
+    finally:
+        RegEx.native = native
+
+    if native is not None:
+        # every string of up to 3 characters gets the same answer from both
+        for pattern, _, _ in cases[:-1] + [("(*a)", "", False)]:
+            compiled = RegEx.compile(pattern)
+            python = RegEx.DFA.from_regex(pattern)
+            alphabet = sorted(set(pattern + "x"))
+            strings = [""]
+            for _ in range(3):
+                strings += [s + a for s in strings if len(s) == len(strings[-1]) for a in alphabet]
+            for string in strings:
+                assert (compiled(string) == python(string))
+        assert (type(RegEx.compile("a.c")) is native.DFA)
+
+
 def main():
     print("testing basic")
     test_basic()
@@ -162,6 +241,13 @@ def main():
     test_union()
     print("testing regular expression to DFA conversion")
     test_regex()
+    print("testing compile and match with and without the native module")
+    test_paths()
+    if RegEx.native is not None:
+        print("testing native module")
+        test_native()
+    else:
+        print("native module not built, skipping its tests")
 
     print("all passed")
 